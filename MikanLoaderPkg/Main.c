@@ -193,7 +193,7 @@ void CopyLoadSegments(Elf64_Ehdr* ehdr) {
   }
 }
 
-EFI_STATUS ReadFile(EFI_FILE_PROTOCOL* file, VOID** buffer) {
+EFI_STATUS GetFileSize(EFI_FILE_PROTOCOL* file, UINTN* file_size) {
   EFI_STATUS status;
 
   UINTN file_info_size = sizeof(EFI_FILE_INFO) + sizeof(CHAR16) * 12;
@@ -207,7 +207,18 @@ EFI_STATUS ReadFile(EFI_FILE_PROTOCOL* file, VOID** buffer) {
   }
 
   EFI_FILE_INFO* file_info = (EFI_FILE_INFO*)file_info_buffer;
-  UINTN file_size = file_info->FileSize;
+  *file_size = file_info->FileSize;
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS ReadFile(EFI_FILE_PROTOCOL* file, VOID** buffer) {
+  EFI_STATUS status;
+
+  UINTN file_size;
+  status = GetFileSize(file, &file_size);
+  if (EFI_ERROR(status)) {
+    return status;
+  }
 
   status = gBS->AllocatePool(EfiLoaderData, file_size, buffer);
   if (EFI_ERROR(status)) {
@@ -217,6 +228,35 @@ EFI_STATUS ReadFile(EFI_FILE_PROTOCOL* file, VOID** buffer) {
   return file->Read(file, &file_size, *buffer);
 }
 
+// the volume image is page aligned so that the kernel can map its clusters to apps directly
+EFI_STATUS AllocateVolumeImage(UINTN bytes, VOID** buffer) {
+  EFI_PHYSICAL_ADDRESS addr;
+  EFI_STATUS status = gBS->AllocatePages(
+      AllocateAnyPages, EfiLoaderData, EFI_SIZE_TO_PAGES(bytes), &addr);
+  if (EFI_ERROR(status)) {
+    return status;
+  }
+  *buffer = (VOID*)addr;
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS ReadVolumeFile(EFI_FILE_PROTOCOL* file, VOID** buffer) {
+  EFI_STATUS status;
+
+  UINTN file_size;
+  status = GetFileSize(file, &file_size);
+  if (EFI_ERROR(status)) {
+    return status;
+  }
+
+  status = AllocateVolumeImage(file_size, buffer);
+  if (EFI_ERROR(status)) {
+    return status;
+  }
+
+  return file->Read(file, &file_size, *buffer);
+}
+
 EFI_STATUS OpenBlockIoProtocolForLoadedImage(
     EFI_HANDLE image_handle, EFI_BLOCK_IO_PROTOCOL** block_io) {
   EFI_STATUS status;
@@ -249,7 +289,7 @@ EFI_STATUS ReadBlocks(
     UINTN read_bytes, VOID** buffer) {
   EFI_STATUS status;
 
-  status = gBS->AllocatePool(EfiLoaderData, read_bytes, buffer);
+  status = AllocateVolumeImage(read_bytes, buffer);
   if (EFI_ERROR(status)) {
     return status;
   }
@@ -375,7 +415,7 @@ EFI_STATUS EFIAPI UefiMain(
     EFI_FILE_MODE_READ, 0
   );
   if (status == EFI_SUCCESS) {
-    status = ReadFile(volume_file, &volume_image);
+    status = ReadVolumeFile(volume_file, &volume_image);
     if (EFI_ERROR(status)) {
       Print(L"failed to read volume file: %r", status);
       Halt();
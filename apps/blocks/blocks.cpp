@@ -93,13 +93,15 @@ extern "C" void main(int argc, char** argv) {
 				}
 				SyscallWinRedraw(layer_id);
 
+				// deadlines in ns do not accumulate the rounding error of 1000 / kFrameRate ms
 				static unsigned long prev_timeout = 0;
 				if (prev_timeout == 0) {
-						const auto timeout = SyscallCreateTimer(TIMER_ONESHOT_REL, 1, 1000 / kFrameRate);
+						const auto timeout = SyscallCreateTimer(TIMER_ONESHOT_REL | TIMER_NS, 1,
+																										1000000000 / kFrameRate);
 						prev_timeout = timeout.value;
 				} else {
-						prev_timeout += 1000 / kFrameRate;
-						SyscallCreateTimer(TIMER_ONESHOT_ABS, 1, prev_timeout);
+						prev_timeout += 1000000000 / kFrameRate;
+						SyscallCreateTimer(TIMER_ONESHOT_ABS | TIMER_NS, 1, prev_timeout);
 				}
 
 				AppEvent events[1];
@@ -67,6 +67,8 @@ ssize_t read(int fd, void* buf, size_t count) {
 caddr_t sbrk(int incr) {
     static uint64_t dpage_end = 0;
 		static uint64_t program_break = 0;
+		// give back pages only when this many bytes above the break are unused, to avoid unmapping and mapping repeatedly
+		const uint64_t kTrimThreshold = 64 * 1024;
 
 		if (dpage_end == 0 || dpage_end < program_break + incr) {
 				int num_pages = (incr + 4095) / 4096;
@@ -75,8 +77,17 @@ caddr_t sbrk(int incr) {
 						errno = ENOMEM;
 						return (caddr_t)-1;
 				}
-				program_break = res.value;
+				if (res.value != dpage_end) { // the break cannot be extended contiguously
+						program_break = res.value;
+				}
 				dpage_end = res.value + 4096 * num_pages;
+		} else if (incr < 0) {
+				// newlib malloc trims the top of the heap by a negative incr. give the pages back.
+				const uint64_t new_dpage_end = (program_break + incr + 4095) & ~(uint64_t)4095;
+				if (dpage_end - new_dpage_end >= kTrimThreshold &&
+						SyscallUnmapPages((void*)new_dpage_end, dpage_end - new_dpage_end).error == 0) {
+						dpage_end = new_dpage_end;
+				}
 		}
 
 		const uint64_t prev_break = program_break;
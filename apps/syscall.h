@@ -37,14 +37,28 @@ extern "C" {
 
 		#define TIMER_ONESHOT_REL 1
 		#define TIMER_ONESHOT_ABS 0
+		/* timeout is in ns instead of ms. an absolute timeout is a value of SyscallClockGetTime */
+		#define TIMER_NS 2
+		/* error ENOMEM: too many timers are pending */
 		struct SyscallResult SyscallCreateTimer(
 				unsigned int type, int timer_value, unsigned long timeout_ms
 		);
+		/* cancel the pending timers of timer_value, or all the timers if it is 0.
+		 * value: the number of cancelled timers */
+		struct SyscallResult SyscallCancelTimer(int timer_value);
 
 		struct SyscallResult SyscallOpenFile(const char* path, int flags);
 		struct SyscallResult SyscallReadFile(int fd, void* buf, size_t count);
+		#define DEMAND_PAGES_HUGE 1
 		struct SyscallResult SyscallDemandPages(size_t num_pages, int flags);
+		#define MAP_FILE_SHARED 1
 		struct SyscallResult SyscallMapFile(int fd, size_t* file_size, int flags);
+		struct SyscallResult SyscallUnmapPages(void* addr, size_t len);
+		#define ADVISE_PAGES_DONTNEED 1
+		struct SyscallResult SyscallAdvisePages(void* addr, size_t len, int advice);
+		struct SyscallResult SyscallSyncPages(void* addr, size_t len);
+		/* value: nanoseconds since boot (monotonic) */
+		struct SyscallResult SyscallClockGetTime();
 
 #ifdef __cplusplus
 } // extern "C"
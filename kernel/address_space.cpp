@@ -0,0 +1,225 @@
+#include "address_space.hpp"
+
+#include <algorithm>
+#include <iterator>
+
+#include "page_cache.hpp"
+#include "paging.hpp"
+
+namespace {
+		const uint64_t kHugePageBytes = 2 * 1024 * 1024;
+
+		uint64_t AlignUp(uint64_t value, uint64_t align) {
+				return (value + align - 1) & ~(align - 1);
+		}
+
+		/** @brief the last address of an area. an area may reach the end of the address space */
+		uint64_t Last(const VMA& vma) {
+				return vma.begin + (vma.size - 1);
+		}
+
+		Error CleanRange(uint64_t begin, uint64_t last) {
+				return CleanPageMaps(LinearAddress4Level{begin}, (last - begin) / 4096 + 1);
+		}
+}
+
+Error AddressSpace::Add(const VMA& vma) {
+		auto next = vmas_.upper_bound(vma.begin);
+		if (next != vmas_.end() && next->first - vma.begin < vma.size) {
+				return MAKE_ERROR(Error::kAlreadyAllocated);
+		}
+		if (next != vmas_.begin() && std::prev(next)->second.Contains(vma.begin)) {
+				return MAKE_ERROR(Error::kAlreadyAllocated);
+		}
+		if (!vmas_.emplace(vma.begin, vma).second) {
+				return MAKE_ERROR(Error::kAlreadyAllocated);
+		}
+		return MAKE_ERROR(Error::kSuccess);
+}
+
+VMA* AddressSpace::Find(uint64_t addr) {
+		auto it = vmas_.upper_bound(addr);
+		if (it == vmas_.begin()) {
+				return nullptr;
+		}
+		--it;
+		return it->second.Contains(addr) ? &it->second : nullptr;
+}
+
+Error AddressSpace::Clear() {
+		for (auto& [ begin, vma ] : vmas_) {
+				if (auto err = CleanArea(vma, begin, Last(vma))) {
+						return err;
+				}
+		}
+		vmas_.clear();
+		dpaging_begin_ = dpaging_end_ = file_map_end_ = 0;
+		return MAKE_ERROR(Error::kSuccess);
+}
+
+Error AddressSpace::Unmap(uint64_t begin, uint64_t size) {
+		if (size == 0) {
+				return MAKE_ERROR(Error::kSuccess);
+		}
+		const uint64_t last = begin + (size - 1);
+		if (last < begin) {
+				return MAKE_ERROR(Error::kIndexOutOfRange);
+		}
+
+		for (auto it = FirstOverlap(begin); it != vmas_.end() && it->first <= last; ) {
+				const VMA vma = it->second;
+				it = vmas_.erase(it);
+
+				if (vma.begin < begin) {
+						VMA lower = vma;
+						lower.size = begin - vma.begin;
+						vmas_.emplace(lower.begin, lower);
+				}
+				if (last < Last(vma)) {
+						VMA upper = vma;
+						upper.begin = last + 1;
+						upper.size = Last(vma) - last;
+						const uint64_t skipped = upper.begin - vma.begin;
+						upper.file_offset += skipped;
+						upper.file_bytes = vma.file_bytes > skipped ? vma.file_bytes - skipped : 0;
+						vmas_.emplace(upper.begin, upper);
+				}
+				if (auto err = CleanArea(vma, std::max(begin, vma.begin), std::min(last, Last(vma)))) {
+						return err;
+				}
+		}
+
+		// let the next ExtendDemandPaging reuse the range if the top of demand paging is unmapped
+		if (dpaging_begin_ <= begin && begin < dpaging_end_ && dpaging_end_ - 1 <= last) {
+				dpaging_end_ = begin;
+		}
+		return MAKE_ERROR(Error::kSuccess);
+}
+
+Error AddressSpace::Discard(uint64_t begin, uint64_t size) {
+		if (size == 0) {
+				return MAKE_ERROR(Error::kSuccess);
+		}
+		const uint64_t last = begin + (size - 1);
+		if (last < begin) {
+				return MAKE_ERROR(Error::kIndexOutOfRange);
+		}
+
+		for (auto it = FirstOverlap(begin); it != vmas_.end() && it->first <= last; ++it) {
+				if (it->second.on_fault == nullptr) {
+						return MAKE_ERROR(Error::kInvalidDescriptor);
+				}
+		}
+		for (auto it = FirstOverlap(begin); it != vmas_.end() && it->first <= last; ++it) {
+				const VMA& vma = it->second;
+				if (auto err = CleanArea(vma, std::max(begin, vma.begin), std::min(last, Last(vma)))) {
+						return err;
+				}
+		}
+		return MAKE_ERROR(Error::kSuccess);
+}
+
+Error AddressSpace::Sync(uint64_t begin, uint64_t size) {
+		if (size == 0) {
+				return MAKE_ERROR(Error::kSuccess);
+		}
+		const uint64_t last = begin + (size - 1);
+		if (last < begin) {
+				return MAKE_ERROR(Error::kIndexOutOfRange);
+		}
+
+		for (auto it = FirstOverlap(begin); it != vmas_.end() && it->first <= last; ++it) {
+				const VMA& vma = it->second;
+				if (!vma.shared) {
+						continue;
+				}
+				if (auto err = WriteBackFilePages(vma, std::max(begin, vma.begin), std::min(last, Last(vma)))) {
+						return err;
+				}
+		}
+		return MAKE_ERROR(Error::kSuccess);
+}
+
+void AddressSpace::SetupDynamicAreas(uint64_t dpaging_begin, uint64_t file_map_end) {
+		dpaging_begin_ = dpaging_end_ = dpaging_begin;
+		file_map_end_ = file_map_end;
+}
+
+WithError<uint64_t> AddressSpace::ExtendDemandPaging(size_t num_bytes, bool align_2m) {
+		uint64_t ext_begin = dpaging_end_;
+		if (align_2m) {
+				ext_begin = AlignUp(ext_begin, kHugePageBytes);
+				num_bytes = AlignUp(num_bytes, kHugePageBytes);
+		}
+		const uint64_t ext_size = AlignUp(num_bytes, 4096);
+		if (ext_size == 0) {
+				return { ext_begin, MAKE_ERROR(Error::kSuccess) };
+		}
+		if (ext_begin + ext_size < ext_begin) {
+				return { 0, MAKE_ERROR(Error::kNoEnoughMemory) };
+		}
+
+		// grow the area just below the extension instead of adding a new one if possible
+		auto next = vmas_.lower_bound(ext_begin);
+		if (next != vmas_.end() && next->first - ext_begin < ext_size) {
+				return { 0, MAKE_ERROR(Error::kNoEnoughMemory) };
+		}
+		if (next != vmas_.begin()) {
+				auto& prev = std::prev(next)->second;
+				if (prev.type == VMA::kDemandPaging && prev.begin + prev.size == ext_begin) {
+						prev.size += ext_size;
+						dpaging_end_ = ext_begin + ext_size;
+						return { ext_begin, MAKE_ERROR(Error::kSuccess) };
+				}
+		}
+
+		if (auto err = Add(VMA{VMA::kDemandPaging, ext_begin, ext_size, true, FillDemandPage})) {
+				return { 0, MAKE_ERROR(Error::kNoEnoughMemory) };
+		}
+		dpaging_end_ = ext_begin + ext_size;
+		return { ext_begin, MAKE_ERROR(Error::kSuccess) };
+}
+
+WithError<uint64_t> AddressSpace::MapFile(std::shared_ptr<::FileDescriptor> file, bool shared) {
+		if (shared && file->FileID() == 0) {
+				return { 0, MAKE_ERROR(Error::kInvalidFile) };
+		}
+		const size_t file_size = file->Size();
+		const uint64_t vaddr_end = file_map_end_;
+		uint64_t vaddr_begin = (vaddr_end - file_size) & ~static_cast<uint64_t>(4095);
+		if (file_size >= kHugePageBytes) {
+				// align large files to 2 MiB so that they can be mapped by 2 MiB pages
+				vaddr_begin &= ~(kHugePageBytes - 1);
+		}
+
+		if (auto err = Add(VMA{VMA::kFileMap, vaddr_begin, vaddr_end - vaddr_begin,
+													 true, shared ? FillSharedFilePage : FillFilePage,
+													 file, 0, file_size, shared})) {
+				return { 0, err };
+		}
+		file_map_end_ = vaddr_begin;
+		return { vaddr_begin, MAKE_ERROR(Error::kSuccess) };
+}
+
+std::map<uint64_t, VMA>::iterator AddressSpace::FirstOverlap(uint64_t addr) {
+		auto it = vmas_.upper_bound(addr);
+		if (it != vmas_.begin() && std::prev(it)->second.Contains(addr)) {
+				--it;
+		}
+		return it;
+}
+
+Error AddressSpace::CleanArea(const VMA& vma, uint64_t begin, uint64_t last) {
+		if (!vma.shared) {
+				return CleanRange(begin, last);
+		}
+		if (auto err = WriteBackFilePages(vma, begin, last)) {
+				return err;
+		}
+		if (auto err = CleanRange(begin, last)) {
+				return err;
+		}
+		// frames nobody maps any longer
+		page_cache->Prune(*vma.file);
+		return MAKE_ERROR(Error::kSuccess);
+}
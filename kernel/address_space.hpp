@@ -0,0 +1,113 @@
+/*
+* file collecting programs to manage virtual memory areas of an application
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+
+#include "error.hpp"
+#include "file.hpp"
+
+class Task;
+struct VMA;
+
+/** @brief map pages of an area on a page fault to a not-present page. write is true for a write access */
+using VMAFaultHandler = Error (Task& task, VMA& vma, uint64_t causal_addr, bool write);
+
+/** @brief virtual memory area: a page aligned range of the address space with the same attributes */
+struct VMA {
+		enum Type {
+				kImage,        // LOAD segments of the executable (file-backed if on_fault is set)
+				kArgs,         // argv and strings
+				kStack,
+				kDemandPaging, // SyscallDemandPages
+				kFileMap,      // SyscallMapFile
+		};
+
+		Type type;
+		uint64_t begin;
+		/** @brief a multiple of 4 KiB. the area may reach the end of the address space */
+		uint64_t size;
+		/** @brief false if writing to the area is an error. otherwise pages are copied on write unless shared */
+		bool writable;
+		/** @brief nullptr if pages are mapped when the area is added */
+		VMAFaultHandler* on_fault;
+		/** @brief the file mapped to the area (kImage, kFileMap) */
+		std::shared_ptr<::FileDescriptor> file;
+		/** @brief the file offset mapped to begin */
+		uint64_t file_offset;
+		/** @brief bytes of the file mapped from begin. the rest of the area is zero-filled */
+		uint64_t file_bytes;
+		/** @brief true if pages are shared with other tasks mapping the file and written back to it */
+		bool shared;
+		/** @brief the page which faults next if the area is accessed sequentially */
+		uint64_t next_fault;
+		/** @brief the number of pages mapped by the last fault */
+		size_t fault_window;
+
+		bool Contains(uint64_t addr) const {
+				return begin <= addr && addr - begin < size;
+		}
+};
+
+/** @brief virtual memory areas in the upper half of an application's address space.
+*
+*   Areas never overlap, so they are kept in a search tree keyed by their beginning
+*   and the area of an address is found in O(log n).
+*
+*   Demand paging areas grow upward from the end of the executable and
+*   files are mapped downward from the bottom of the stack.
+*/
+class AddressSpace {
+		public:
+				/** @brief add an area. kAlreadyAllocated is returned if it overlaps others */
+				Error Add(const VMA& vma);
+				/** @brief return the area containing addr, or nullptr */
+				VMA* Find(uint64_t addr);
+				const std::map<uint64_t, VMA>& Areas() const { return vmas_; }
+				/** @brief unmap pages of all the areas in the current page map and remove the areas */
+				Error Clear();
+				/** @brief remove [begin, begin + size) from the areas and release its pages.
+				*
+				*   Areas partially in the range are shrunk or split. Addresses out of any area are ignored.
+				*/
+				Error Unmap(uint64_t begin, uint64_t size);
+				/** @brief release pages in [begin, begin + size) keeping the areas.
+				*
+				*   The pages are filled again by the fault handlers of the areas when they are accessed:
+				*   zero-filled for demand paging and re-read for file maps.
+				*   kInvalidDescriptor is returned if the range overlaps an area without a fault handler.
+				*/
+				Error Discard(uint64_t begin, uint64_t size);
+				/** @brief write modified pages of shared file maps in [begin, begin + size) back to the files */
+				Error Sync(uint64_t begin, uint64_t size);
+
+				/** @brief demand paging begins at dpaging_begin and files are mapped below file_map_end */
+				void SetupDynamicAreas(uint64_t dpaging_begin, uint64_t file_map_end);
+				/** @brief map num_bytes at the end of demand paging and return the beginning of them.
+				*
+				*   If align_2m is true, the extension is aligned to 2 MiB so that it can be
+				*   mapped by 2 MiB pages.
+				*/
+				WithError<uint64_t> ExtendDemandPaging(size_t num_bytes, bool align_2m);
+				/** @brief add an area to map the whole file and return its beginning.
+				*
+				*   If shared is true, the pages are shared with other tasks mapping the file and
+				*   modifications are written back to the file by Sync, Unmap, Discard and Clear.
+				*/
+				WithError<uint64_t> MapFile(std::shared_ptr<::FileDescriptor> file, bool shared);
+
+		private:
+				std::map<uint64_t, VMA> vmas_{}; // key: VMA::begin
+				uint64_t dpaging_begin_{0}, dpaging_end_{0};
+				uint64_t file_map_end_{0};
+
+				/** @brief return the first area which overlaps [addr, ...) */
+				std::map<uint64_t, VMA>::iterator FirstOverlap(uint64_t addr);
+				/** @brief write back [begin, last] of the area if it is a shared file map, and then unmap it */
+				Error CleanArea(const VMA& vma, uint64_t begin, uint64_t last);
+};
@@ -28,7 +28,7 @@ struct AppEvent {
 			} mouse_button;
 
 			struct {
-				unsigned long timeout;
+				unsigned long timeout; // ns since boot
 				int value;
 			} timer;
 
@@ -96,6 +96,37 @@ GetCR3:
     mov rax, cr3
     ret
 
+global GetCR4		; uint64_t GetCR4();
+GetCR4:
+		mov rax, cr4
+		ret
+
+global SetCR4		; void SetCR4(uint64_t value);
+SetCR4:
+		mov cr4, rdi
+		ret
+
+global ReadCPUID	; void ReadCPUID(uint32_t leaf, uint32_t subleaf, uint32_t* regs);
+ReadCPUID:
+		push rbx
+		mov r8, rdx		; regs
+		mov eax, edi
+		mov ecx, esi
+		cpuid
+		mov [r8], eax
+		mov [r8 + 4], ebx
+		mov [r8 + 8], ecx
+		mov [r8 + 12], edx
+		pop rbx
+		ret
+
+global ReadTSC	; uint64_t ReadTSC();
+ReadTSC:
+		rdtsc
+		shl rdx, 32
+		or rax, rdx
+		ret
+
 extern kernel_main_stack
 extern KernelMainNewStack
 
@@ -148,6 +179,8 @@ SwitchContext:  ; void SwitchContext(void* next_ctx, void* current_ctx);
     fxsave [rsi + 0xc0]
 		; fall through to RestoreContext
 
+extern cr3_no_flush
+
 global RestoreContext
 RestoreContext:		; void RestoreContext(void* task_context);
     ; stuck frame for iret
@@ -160,7 +193,11 @@ RestoreContext:		; void RestoreContext(void* task_context);
     ; store context
     fxrstor [rdi + 0xc0]
 
+    btr qword [rdi + 0x00], 62  ; kCR3FlushOnRestore: TLB entries of the PCID are stale
     mov rax, [rdi + 0x00]
+    jc .load_cr3
+    or rax, [cr3_no_flush]  ; keep TLB entries of the PCID if PCID is enabled
+.load_cr3:
     mov cr3, rax
     mov rax, [rdi + 0x30]
     mov fs, ax
@@ -15,6 +15,12 @@ extern "C" {
 		uint64_t GetCR2();
     void SetCR3(uint64_t value);
     uint64_t GetCR3();
+		uint64_t GetCR4();
+		void SetCR4(uint64_t value);
+		/** @brief execute cpuid and store eax, ebx, ecx, edx to regs[0..3] */
+		void ReadCPUID(uint32_t leaf, uint32_t subleaf, uint32_t* regs);
+		/** @brief return the time stamp counter */
+		uint64_t ReadTSC();
     void SwitchContext(void* next_ctx, void* current_ctx);
 		void RestoreContext(void* ctx);
 		int CallApp(int argc, char** argv, uint16_t ss, uint64_t rip, uint64_t rsp, uint64_t* os_stack_ptr);
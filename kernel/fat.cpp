@@ -5,7 +5,9 @@
 #include <cctype>
 #include <utility>
 
+#include "image_cache.hpp"
 #include "logger.hpp"
+#include "page_cache.hpp"
 
 namespace {
 
@@ -284,6 +286,11 @@ namespace fat {
 		}
 
 		size_t FileDescriptor::Write(const void* buf, size_t len) {
+				// cached executables of the file become stale
+				if (fat_entry_.FirstCluster() != 0) {
+						image_cache->Invalidate(fat_entry_.FirstCluster());
+				}
+
 				auto num_cluster = [](size_t bytes) {
 						return (bytes + bytes_per_cluster - 1) / bytes_per_cluster;
 				};
@@ -322,6 +329,10 @@ namespace fat {
 						wr_cluster_off_ += n;
 				}
 
+				// pages of the file mapped shared must show the new bytes
+				if (page_cache) {
+						page_cache->Update(FileID(), wr_off_, buf, len);
+				}
 				wr_off_ += total;
 				fat_entry_.file_size = wr_off_;
 				return total;
@@ -342,4 +353,74 @@ namespace fat {
 				return fd.Read(buf, len);
 		}
 
+		size_t FileDescriptor::Store(const void* buf, size_t len, size_t offset) {
+				if (offset >= fat_entry_.file_size) {
+						return 0;
+				}
+				len = std::min(len, fat_entry_.file_size - offset);
+				image_cache->Invalidate(fat_entry_.FirstCluster());
+				if (page_cache) {
+						page_cache->Update(FileID(), offset, buf, len);
+				}
+
+				unsigned long cluster = fat_entry_.FirstCluster();
+				while (offset >= bytes_per_cluster) {
+						offset -= bytes_per_cluster;
+						cluster = NextCluster(cluster);
+				}
+
+				const uint8_t* buf8 = reinterpret_cast<const uint8_t*>(buf);
+				size_t total = 0;
+				while (total < len) {
+						uint8_t* sec = GetSectorByCluster<uint8_t>(cluster);
+						size_t n = std::min(len - total, bytes_per_cluster - offset);
+						// buf may be the very bytes in the volume image (a resident page mapped shared)
+						memmove(&sec[offset], &buf8[total], n);
+						total += n;
+
+						offset = 0;
+						cluster = NextCluster(cluster);
+				}
+				return total;
+		}
+
+		const void* FileDescriptor::ResidentPage(size_t offset) {
+				const size_t kPageBytes = 4096;
+				if (offset % kPageBytes != 0 || fat_entry_.file_size < offset + kPageBytes) {
+						return nullptr;
+				}
+
+				const size_t cluster_index = offset / bytes_per_cluster;
+				unsigned long cluster = fat_entry_.FirstCluster();
+				size_t i = 0;
+				if (page_cluster_ != 0 && page_cluster_index_ <= cluster_index) {
+						cluster = page_cluster_;
+						i = page_cluster_index_;
+				}
+				for (; i < cluster_index; ++i) {
+						cluster = NextCluster(cluster);
+						if (cluster == kEndOfClusterchain) {
+								return nullptr;
+						}
+				}
+				page_cluster_ = cluster;
+				page_cluster_index_ = cluster_index;
+
+				const uintptr_t page = GetClusterAddr(cluster) + offset % bytes_per_cluster;
+				if (page % kPageBytes != 0) {
+						return nullptr;
+				}
+
+				// a page over several clusters is contiguous only if they are consecutive
+				size_t covered = bytes_per_cluster - offset % bytes_per_cluster;
+				for (; covered < kPageBytes; covered += bytes_per_cluster) {
+						const auto next = NextCluster(cluster);
+						if (next != cluster + 1) {
+								return nullptr;
+						}
+						cluster = next;
+				}
+				return reinterpret_cast<const void*>(page);
+		}
+
 } // namespace fat
\ No newline at end of file
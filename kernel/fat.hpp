@@ -189,6 +189,13 @@ namespace fat {
 						size_t Write(const void* buf, size_t len) override;
 						size_t Size() const override { return fat_entry_.file_size; }
 						size_t Load(void* buf, size_t len, size_t offset) override;
+						/** @brief the page in the volume image if its clusters are contiguous and page aligned.
+						*   The last partial page of a file is not resident because the rest of it is not zero.
+						*/
+						const void* ResidentPage(size_t offset) override;
+						size_t Store(const void* buf, size_t len, size_t offset) override;
+						/** @brief the first cluster. an empty file has no cluster and cannot be shared */
+						uint64_t FileID() const override { return fat_entry_.FirstCluster(); }
 				
 				private:
 						DirectoryEntry& fat_entry_;
@@ -198,6 +205,11 @@ namespace fat {
 						size_t wr_off_ = 0;
 						unsigned long wr_cluster_ = 0;
 						size_t wr_cluster_off_ = 0;
+						/** @brief the cluster ResidentPage found last and its index in the chain (0 if none).
+						*   Mapping a file asks pages in order, so walking the chain resumes from it.
+						*/
+						unsigned long page_cluster_ = 0;
+						size_t page_cluster_index_ = 0;
 		};
 
 } // namespace fat
\ No newline at end of file
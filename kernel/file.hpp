@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstddef>
+#include <cstdint>
 // #include "error.hpp"
 
 class FileDescriptor {
@@ -12,6 +13,21 @@ class FileDescriptor {
 
 				/** @brief Load file content without changing internal offset */
 				virtual size_t Load(void* buf, size_t len, size_t offset) = 0;
+
+				/** @brief return the 4 KiB aligned address where [offset, offset + 4 KiB) of the file
+				*   already resides in memory contiguously, or nullptr if there is no such address.
+				*/
+				virtual const void* ResidentPage(size_t offset) { return nullptr; }
+
+				/** @brief Store buf to the file at offset without changing internal offset.
+				*   The file is not extended. Return the number of bytes stored.
+				*/
+				virtual size_t Store(const void* buf, size_t len, size_t offset) { return 0; }
+
+				/** @brief a nonzero value identifying the file among descriptors of the same file system,
+				*   or 0 if the file cannot be mapped shared
+				*/
+				virtual uint64_t FileID() const { return 0; }
 };
 
 size_t PrintToFD(FileDescriptor& fd, const char* format, ...);
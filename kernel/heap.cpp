@@ -0,0 +1,77 @@
+#include "heap.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <sys/types.h>
+
+#include "memory_manager.hpp"
+#include "paging.hpp"
+#include "logger.hpp"
+
+extern "C" caddr_t program_break, program_break_end;
+
+namespace {
+		/** @brief the heap is mapped or unmapped by this granularity at least */
+		const size_t kHeapChunkBytes = 64_KiB;
+		const size_t kInitialHeapBytes = 1_MiB;
+
+		size_t heap_high_water;
+
+		uint64_t ChunkCeil(uint64_t addr) {
+				return (addr + kHeapChunkBytes - 1) & ~(kHeapChunkBytes - 1);
+		}
+}
+
+/** @brief map frames so that the heap covers [kHeapBegin, new_break). return 0 on success */
+extern "C" int ExtendHeap(caddr_t new_break) {
+		const auto cur_end = reinterpret_cast<uint64_t>(program_break_end);
+		const auto new_end = ChunkCeil(reinterpret_cast<uint64_t>(new_break));
+		if (new_end <= cur_end) {
+				return 0;
+		}
+		if (new_end > kHeapBegin + kHeapMaxBytes) {
+				return -1;
+		}
+
+		const size_t num_pages = (new_end - cur_end) / kBytesPerFrame;
+		// this runs inside malloc. reclaimers would free memory to newlib and corrupt the heap.
+		memory_manager->SuppressReclaim();
+		const auto err = MapKernelPages(LinearAddress4Level{cur_end}, num_pages);
+		memory_manager->ResumeReclaim();
+		if (err) {
+				UnmapKernelPages(LinearAddress4Level{cur_end}, num_pages);
+				return -1;
+		}
+		program_break_end = reinterpret_cast<caddr_t>(new_end);
+		heap_high_water = std::max<size_t>(heap_high_water, new_end - kHeapBegin);
+		return 0;
+}
+
+/** @brief unmap whole chunks above new_break and give their frames back */
+extern "C" void ShrinkHeap(caddr_t new_break) {
+		const auto cur_end = reinterpret_cast<uint64_t>(program_break_end);
+		const auto new_end = ChunkCeil(reinterpret_cast<uint64_t>(new_break));
+		if (new_end >= cur_end) {
+				return;
+		}
+
+		UnmapKernelPages(LinearAddress4Level{new_end}, (cur_end - new_end) / kBytesPerFrame);
+		program_break_end = reinterpret_cast<caddr_t>(new_end);
+}
+
+HeapStat GetHeapStat() {
+		return {
+				static_cast<size_t>(reinterpret_cast<uint64_t>(program_break) - kHeapBegin),
+				static_cast<size_t>(reinterpret_cast<uint64_t>(program_break_end) - kHeapBegin),
+				heap_high_water,
+		};
+}
+
+void InitializeHeap() {
+		program_break = reinterpret_cast<caddr_t>(kHeapBegin);
+		program_break_end = program_break;
+		if (ExtendHeap(program_break + kInitialHeapBytes) != 0) {
+				Log(kError, "failed to map the initial heap\n");
+				exit(1);
+		}
+}
@@ -0,0 +1,32 @@
+/*
+* file collecting programs to manage the kernel heap used by newlib malloc
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/** @brief beginning of the virtual address range of the kernel heap (PML4 entry 255) */
+const uint64_t kHeapBegin = 0x0000'7f80'0000'0000;
+/** @brief size of the virtual address range of the kernel heap (covered by one PML4 entry) */
+const uint64_t kHeapMaxBytes = 512ull * 1024 * 1024 * 1024;
+
+struct HeapStat {
+		/** @brief bytes between the beginning of the heap and the program break */
+		size_t used_bytes;
+		/** @brief bytes backed by frames */
+		size_t mapped_bytes;
+		/** @brief max of mapped_bytes since boot */
+		size_t high_water_bytes;
+};
+
+HeapStat GetHeapStat();
+
+/** @brief map the initial heap and set up the program break.
+*
+*   Afterwards sbrk maps frames on demand and unmaps whole pages when the break goes down.
+*   Must be called after InitializeMemoryManager and before any task is created,
+*   so that the PML4 entry of the heap is copied into every page map.
+*/
+void InitializeHeap();
@@ -0,0 +1,161 @@
+#include "image_cache.hpp"
+
+#include <new>
+
+#include "interrupt.hpp"
+#include "memory_manager.hpp"
+
+namespace {
+		const size_t kImageCacheBudgetBytes = 16 * 1024 * 1024;
+}
+
+ImageCache::ImageCache(size_t budget_bytes) : budget_bytes_{budget_bytes} {
+}
+
+std::optional<AppLoadInfo> ImageCache::Find(const fat::DirectoryEntry& file) {
+		InterruptGuard guard;
+		++num_lookups_;
+		const Key key = KeyOf(file);
+		for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+				if (!it->stale && it->key == key) {
+						++num_hits_;
+						entries_.splice(entries_.begin(), entries_, it);
+						if (it->info.pml4) {
+								++it->pins;
+						}
+						return it->info;
+				}
+		}
+		return std::nullopt;
+}
+
+void ImageCache::Unpin(const PageMapEntry* pml4) {
+		InterruptGuard guard;
+		busy_ = true;
+		for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+				if (it->info.pml4 == pml4 && it->pins > 0) {
+						if (--it->pins == 0 && it->stale) {
+								Erase(it);
+						}
+						break;
+				}
+		}
+		busy_ = false;
+}
+
+void ImageCache::Insert(const fat::DirectoryEntry& file, const AppLoadInfo& info) {
+		InterruptGuard guard;
+		busy_ = true;
+		size_t resident_bytes = 0;
+		if (info.pml4) {
+				for (const auto& segment : info.segments) {
+						resident_bytes += segment.size;
+				}
+		}
+
+		while (entries_.size() >= kMaxEntries ||
+					 resident_bytes_ + resident_bytes > budget_bytes_) {
+				auto victim = EvictionCandidate();
+				if (victim == entries_.end()) {
+						break;
+				}
+				Erase(victim);
+				++num_evictions_;
+		}
+		// pinned entries may keep the cache over the limits. the new entry is not kept then.
+		if (entries_.size() < kMaxEntries && resident_bytes_ + resident_bytes <= budget_bytes_) {
+				entries_.push_front(Entry{KeyOf(file), info, resident_bytes, 0, false});
+				resident_bytes_ += resident_bytes;
+		} else if (info.pml4) {
+				// too large to keep, or pinned entries fill the cache. the next run loads it again.
+				FreePageMaps(info.pml4);
+		}
+		busy_ = false;
+}
+
+void ImageCache::Invalidate(uint32_t first_cluster) {
+		InterruptGuard guard;
+		busy_ = true;
+		for (auto it = entries_.begin(); it != entries_.end(); ) {
+				if (it->key.first_cluster == first_cluster && !it->stale) {
+						++num_invalidations_;
+						if (it->pins > 0) {
+								// being copied. Unpin erases it.
+								it->stale = true;
+								++it;
+						} else {
+								it = Erase(it);
+						}
+				} else {
+						++it;
+				}
+		}
+		busy_ = false;
+}
+
+size_t ImageCache::Reclaim(size_t num_frames) {
+		InterruptGuard guard;
+		if (busy_) {
+				// called back from an allocation during Insert / Invalidate
+				return 0;
+		}
+		size_t num_released = 0;
+		auto it = entries_.end();
+		while (it != entries_.begin() && num_released < num_frames) {
+				--it;
+				if (it->resident_bytes == 0 || it->pins > 0) {
+						continue;
+				}
+				num_released += it->resident_bytes / kBytesPerFrame;
+				it = Erase(it);
+				++num_evictions_;
+		}
+		return num_released;
+}
+
+ImageCacheStat ImageCache::Stat() const {
+		return {
+				entries_.size(),
+				resident_bytes_,
+				budget_bytes_,
+				num_lookups_,
+				num_hits_,
+				num_evictions_,
+				num_invalidations_,
+		};
+}
+
+ImageCache::Key ImageCache::KeyOf(const fat::DirectoryEntry& file) {
+		return { file.FirstCluster(), file.file_size, file.write_date, file.write_time };
+}
+
+std::list<ImageCache::Entry>::iterator ImageCache::EvictionCandidate() {
+		for (auto it = entries_.end(); it != entries_.begin(); ) {
+				--it;
+				if (it->pins == 0) {
+						return it;
+				}
+		}
+		return entries_.end();
+}
+
+std::list<ImageCache::Entry>::iterator ImageCache::Erase(std::list<Entry>::iterator it) {
+		if (it->info.pml4) {
+				FreePageMaps(it->info.pml4);
+		}
+		resident_bytes_ -= it->resident_bytes;
+		return entries_.erase(it);
+}
+
+ImageCache* image_cache;
+
+namespace {
+		alignas(ImageCache) char image_cache_buf[sizeof(ImageCache)];
+}
+
+void InitializeImageCache() {
+		image_cache = new(image_cache_buf) ImageCache{kImageCacheBudgetBytes};
+		memory_manager->AddReclaimer([](size_t num_frames) {
+				return image_cache->Reclaim(num_frames);
+		});
+}
@@ -0,0 +1,106 @@
+/*
+* file collecting programs to cache loaded executables for later runs
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <optional>
+#include <vector>
+
+#include "address_space.hpp"
+#include "fat.hpp"
+#include "paging.hpp"
+
+struct AppLoadInfo {
+		uint64_t vaddr_end, entry;
+		/** @brief the page map with segments loaded. nullptr if segments are mapped on demand */
+		PageMapEntry* pml4;
+		/** @brief areas of LOAD segments. segments sharing a page are merged if loaded at once */
+		std::vector<VMA> segments;
+};
+
+struct ImageCacheStat {
+		size_t entries;
+		/** @brief bytes of segments held in page maps of cached entries */
+		size_t resident_bytes;
+		size_t budget_bytes;
+		size_t lookups, hits;
+		/** @brief entries dropped to keep the budget or to reclaim memory */
+		size_t evictions;
+		/** @brief entries dropped because their files were written */
+		size_t invalidations;
+};
+
+/** @brief LRU cache of loaded executables keyed by file identity.
+*
+*   A file is identified by its first cluster, size and write time, so a rewritten or
+*   replaced file never hits a stale entry. Entries whose segments are loaded at once hold
+*   a page map sharing the frames with running instances. Their bytes are limited by the
+*   budget, and they are evicted from the least recently used one.
+*/
+class ImageCache {
+		public:
+				static const size_t kMaxEntries = 32;
+
+				explicit ImageCache(size_t budget_bytes);
+				/** @brief look up the file. An entry with a page map is pinned until Unpin(info.pml4),
+				*   so that its page map is not freed while the caller copies it.
+				*/
+				std::optional<AppLoadInfo> Find(const fat::DirectoryEntry& file);
+				/** @brief unpin the entry found by Find. pml4 is AppLoadInfo::pml4 returned by it */
+				void Unpin(const PageMapEntry* pml4);
+				/** @brief add an entry, evicting others to fit in the budget. The cache owns info.pml4 */
+				void Insert(const fat::DirectoryEntry& file, const AppLoadInfo& info);
+				/** @brief drop entries of the file whose first cluster is given */
+				void Invalidate(uint32_t first_cluster);
+				/** @brief evict entries until num_frames frames are released and return the number of them.
+				*
+				*   Frames shared with running instances are actually freed when the instances exit.
+				*/
+				size_t Reclaim(size_t num_frames);
+				ImageCacheStat Stat() const;
+
+		private:
+				struct Key {
+						uint32_t first_cluster;
+						uint32_t file_size;
+						uint16_t write_date, write_time;
+
+						bool operator==(const Key& rhs) const {
+								return first_cluster == rhs.first_cluster && file_size == rhs.file_size &&
+									write_date == rhs.write_date && write_time == rhs.write_time;
+						}
+				};
+
+				struct Entry {
+						Key key;
+						AppLoadInfo info;
+						size_t resident_bytes;
+						/** @brief the number of Find callers copying info.pml4. never evicted while pinned */
+						int pins;
+						/** @brief invalidated while pinned. erased when unpinned and never found */
+						bool stale;
+				};
+
+				static Key KeyOf(const fat::DirectoryEntry& file);
+				/** @brief release the page map of the entry and remove it. return the next entry */
+				std::list<Entry>::iterator Erase(std::list<Entry>::iterator it);
+				/** @brief the least recently used entry which can be evicted, or entries_.end() */
+				std::list<Entry>::iterator EvictionCandidate();
+
+				/** @brief the most recently used entry first */
+				std::list<Entry> entries_{};
+				size_t budget_bytes_;
+				size_t resident_bytes_{0};
+				size_t num_lookups_{0}, num_hits_{0}, num_evictions_{0}, num_invalidations_{0};
+				/** @brief true while entries_ is being modified. Reclaim does nothing meanwhile */
+				bool busy_{false};
+};
+
+extern ImageCache* image_cache;
+
+/** @brief create image_cache and register it as a reclaimer of memory_manager */
+void InitializeImageCache();
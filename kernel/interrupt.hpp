@@ -70,6 +70,28 @@ struct InterruptFrame {
     uint64_t ss;
 };
 
+/** @brief disable interrupts in the scope and restore IF when leaving it.
+*
+*   Unlike a pair of cli / sti, this can be used by code which may be called
+*   with interrupts already disabled (e.g. from interrupt handlers).
+*/
+class InterruptGuard {
+    public:
+        InterruptGuard() {
+            __asm__ volatile("pushfq\n\tpopq %0\n\tcli" : "=r"(rflags_) : : "memory");
+        }
+        ~InterruptGuard() {
+            if (rflags_ & 0x200) {
+                __asm__ volatile("sti" : : : "memory");
+            }
+        }
+        InterruptGuard(const InterruptGuard&) = delete;
+        InterruptGuard& operator=(const InterruptGuard&) = delete;
+
+    private:
+        uint64_t rflags_;
+};
+
 void NotifyEndOfInterrupt();
 
 void InitializeInterrupt();
\ No newline at end of file
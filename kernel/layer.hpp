@@ -11,13 +11,14 @@
 #include "graphics.hpp"
 #include "window.hpp"
 #include "message.hpp"
+#include "slab.hpp"
 
 /** @brief Layer indicates one layer 
 *
 *   In the future, this will have multiple windows.
 *   At present, this can have only one though...
 */
-class Layer {
+class Layer : public SlabObject {
     public:
         /** @brief generate a layer with given ID */
         Layer(unsigned int id = 0);
@@ -38,6 +38,11 @@
 #include "terminal.hpp"
 #include "fat.hpp"
 #include "syscall.hpp"
+#include "slab.hpp"
+#include "heap.hpp"
+#include "page_cache.hpp"
+#include "swap.hpp"
+#include "page_merge.hpp"
 
 int printk(const char* format, ...) {
     va_list ap;
@@ -158,6 +163,9 @@ extern "C" void KernelMainNewStack(const FrameBufferConfig& frame_buffer_config_
     InitializeSegmentation();
     InitializePaging();
     InitializeMemoryManager(memory_map);
+    ExtendIdentityMapping(memory_map);
+    InitializeHeap();
+    InitializeSlab();
 		InitializeTSS();
     InitializeInterrupt();
 
@@ -174,20 +182,24 @@ extern "C" void KernelMainNewStack(const FrameBufferConfig& frame_buffer_config_
     InitializeLAPICTimer();
 
     const int kTextboxCursorTimer = 1;
-    const int kTimer05Sec = static_cast<int>(kTimerFreq * 0.5);
-    timer_manager->AddTimer(Timer{kTimer05Sec, kTextboxCursorTimer, 1});
+    const unsigned long kTimer05Sec = kNanosecondsPerSecond / 2;
     bool textbox_cursor_visible = false;
 
 		InitializeSyscall();
 
     InitializeTask();
     Task& main_task = task_manager->CurrentTask();
+    // timers are chained to their tasks, so the first one is added after InitializeTask
+    timer_manager->AddTimer(Timer{CurrentNanoseconds() + kTimer05Sec, kTextboxCursorTimer, 1});
 
     usb::xhci::Initialize();
     InitializeKeyboard();
     InitializeMouse();
 
-		app_loads = new std::map<fat::DirectoryEntry*, AppLoadInfo>;
+    InitializeImageCache();
+    InitializePageCache();
+    InitializeSwap();
+    InitializePageMerge();
     task_manager->NewTask()
         .InitContext(TaskTerminal, 0)
         .Wakeup();
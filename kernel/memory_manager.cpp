@@ -1,54 +1,212 @@
 #include "memory_manager.hpp"
 
+#include <algorithm>
 #include <bitset>
+#include <cstring>
+
+#include "interrupt.hpp"
 #include "logger.hpp"
+#include "paging.hpp"
+
+namespace {
+    using MapLineType = BitmapMemoryManager::MapLineType;
+    const MapLineType kFullLine = ~static_cast<MapLineType>(0);
 
-BitmapMemoryManager::BitmapMemoryManager()
-    : alloc_map_{}, range_begin_{FrameID{0}}, range_end_{FrameID{kFrameCount}} {
+    /** @brief index of the lowest set bit. value must not be 0. */
+    inline size_t LowestSetBit(MapLineType value) {
+        return __builtin_ctzl(value);
+    }
+
+    /** @brief max order of the block which starts from the given frame and does not exceed end */
+    int MaxBlockOrder(size_t frame, size_t end) {
+        int order = 0;
+        while (order < kMaxFrameOrder &&
+               frame % (static_cast<size_t>(2) << order) == 0 &&
+               frame + (static_cast<size_t>(2) << order) <= end) {
+            ++order;
+        }
+        return order;
+    }
+
+    /** @brief the number of map lines to hold the given number of bits */
+    size_t MapLines(size_t num_bits) {
+        const auto bits = BitmapMemoryManager::kBitsPerMapLine;
+        return (num_bits + bits - 1) / bits;
+    }
+
+    /** @brief the number of lines of free block bitmaps of order 1 ~ kMaxFrameOrder */
+    size_t BlockMapLines(size_t frame_count) {
+        size_t num_lines = 0;
+        for (int order = 1; order <= kMaxFrameOrder; ++order) {
+            num_lines += MapLines(frame_count >> order);
+        }
+        return num_lines;
+    }
+}
+
+size_t BitmapMemoryManager::MapBytes(size_t frame_count) {
+    const size_t map_lines = MapLines(frame_count);
+    return (map_lines + MapLines(map_lines) + BlockMapLines(frame_count)) * sizeof(MapLineType);
+}
+
+BitmapMemoryManager::BitmapMemoryManager(size_t frame_count, void* map_buffer)
+    : frame_count_{frame_count}, map_line_count_{MapLines(frame_count)},
+      alloc_map_{reinterpret_cast<MapLineType*>(map_buffer)},
+      full_map_{alloc_map_ + map_line_count_},
+      range_begin_{FrameID{0}}, range_end_{FrameID{frame_count}}, free_line_hint_{0},
+      free_blocks_{full_map_ + MapLines(map_line_count_)},
+      num_free_blocks_{}, free_block_hint_{} {
+    memset(map_buffer, 0, MapBytes(frame_count));
+
+    block_map_offset_.fill(0);
+    for (int order = 1; order <= kMaxFrameOrder; ++order) {
+        block_map_offset_[order + 1] = block_map_offset_[order] + MapLines(frame_count >> order);
+    }
+
+    // frames beyond the end in the last line do not exist. never find them free.
+    const auto tail_bits = frame_count % kBitsPerMapLine;
+    if (tail_bits != 0) {
+        alloc_map_[map_line_count_ - 1] = kFullLine << tail_bits;
+    }
+    AddFreeRange(0, frame_count);
 }
 
 WithError<FrameID> BitmapMemoryManager::Allocate(size_t num_frames) {
-    size_t start_frame_id = range_begin_.ID();
+    auto result = AllocateFrames(num_frames);
+    if (result.error.Cause() == Error::kNoEnoughMemory && Reclaim(num_frames)) {
+        result = AllocateFrames(num_frames);
+    }
+    return result;
+}
+
+WithError<FrameID> BitmapMemoryManager::AllocateFrames(size_t num_frames) {
+    const size_t hint_frame = free_line_hint_ * kBitsPerMapLine;
+    FrameID start_frame = FindFreeFrame(FrameID{std::max(range_begin_.ID(), hint_frame)});
+    if (start_frame.ID() != kNullFrame.ID()) {
+        // no free frame exists in the lines before this one
+        free_line_hint_ = start_frame.ID() / kBitsPerMapLine;
+    }
+
     while (true) {
-        size_t i = 0;
-        for (; i<num_frames; ++i) {
-            if (start_frame_id + i >= range_end_.ID()) {
-                return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
-            }
-            if (GetBit(FrameID{start_frame_id + i})) {
-                // already allocate a frame at "start_frame_id + i"
-                break;
-            }
+        if (start_frame.ID() == kNullFrame.ID() ||
+            start_frame.ID() + num_frames > range_end_.ID()) {
+            return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
         }
-        if (i == num_frames) {
+
+        const size_t num_free = CountFreeFrames(start_frame, num_frames);
+        if (num_free == num_frames) {
             // find free memories of size of num_frames
-            MarkAllocated(FrameID{start_frame_id}, num_frames);
+            MarkAllocated(start_frame, num_frames);
             return {
-                FrameID{start_frame_id},
+                start_frame,
                 MAKE_ERROR(Error::kSuccess),
             };
         }
-        // search again from the next frame
-        start_frame_id += i + 1;
+        // frame at "start_frame + num_free" is already allocated. search again after it.
+        start_frame = FindFreeFrame(FrameID{start_frame.ID() + num_free + 1});
     }
 }
 
 Error BitmapMemoryManager::Free(FrameID start_frame, size_t num_frames) {
-    for (size_t i=0; i<num_frames; ++i) {
-        SetBit(FrameID{start_frame.ID() + i}, false);
+    SetBits(start_frame, num_frames, false);
+    free_line_hint_ = std::min(free_line_hint_, start_frame.ID() / kBitsPerMapLine);
+
+    // give back frames within the memory range to buddy system block by block
+    size_t frame = std::max(start_frame.ID(), range_begin_.ID());
+    const size_t end = std::min(start_frame.ID() + num_frames, range_end_.ID());
+    while (frame < end) {
+        const int order = MaxBlockOrder(frame, end);
+        FreeBlock(frame, order);
+        frame += static_cast<size_t>(1) << order;
     }
     return MAKE_ERROR(Error::kSuccess);
 }
 
 void BitmapMemoryManager::MarkAllocated(FrameID start_frame, size_t num_frames) {
-    for (size_t i=0; i<num_frames; ++i) {
-        SetBit(FrameID{start_frame.ID() + i}, true);
+    CarveFreeBlocks(start_frame.ID(), start_frame.ID() + num_frames);
+    SetBits(start_frame, num_frames, true);
+}
+
+WithError<FrameID> BitmapMemoryManager::AllocateOrder(int order) {
+    if (order < 0 || kMaxFrameOrder < order) {
+        return {kNullFrame, MAKE_ERROR(Error::kIndexOutOfRange)};
+    }
+    if (order == 0) {
+        return Allocate(1);
+    }
+
+    auto result = AllocateBlock(order);
+    if (result.error.Cause() == Error::kNoEnoughMemory &&
+        Reclaim(static_cast<size_t>(1) << order)) {
+        result = AllocateBlock(order);
+    }
+    return result;
+}
+
+WithError<FrameID> BitmapMemoryManager::AllocateBlock(int order) {
+    if (order < 0 || kMaxFrameOrder < order) {
+        return {kNullFrame, MAKE_ERROR(Error::kIndexOutOfRange)};
+    }
+    int found_order = order;
+    while (found_order <= kMaxFrameOrder && num_free_blocks_[found_order] == 0) {
+        ++found_order;
+    }
+    if (found_order > kMaxFrameOrder) {
+        return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+    }
+
+    // find the lowest free block of found_order
+    size_t block_index = free_block_hint_[found_order] * kBitsPerMapLine;
+    while (BlockMapLine(found_order, block_index) == 0) {
+        block_index += kBitsPerMapLine;
+    }
+    free_block_hint_[found_order] = block_index / kBitsPerMapLine;
+    block_index += LowestSetBit(BlockMapLine(found_order, block_index));
+    const size_t frame = block_index << found_order;
+
+    // split the block and give back the upper halves
+    RemoveFreeBlock(frame, found_order);
+    for (int k = found_order - 1; k >= order; --k) {
+        AddFreeBlock(frame + (static_cast<size_t>(1) << k), k);
+    }
+    SetBits(FrameID{frame}, static_cast<size_t>(1) << order, true);
+    return {FrameID{frame}, MAKE_ERROR(Error::kSuccess)};
+}
+
+Error BitmapMemoryManager::AddReclaimer(MemoryReclaimer* reclaimer) {
+    if (num_reclaimers_ == kMaxReclaimers) {
+        return MAKE_ERROR(Error::kFull);
+    }
+    reclaimers_[num_reclaimers_++] = reclaimer;
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+bool BitmapMemoryManager::Reclaim(size_t num_frames) {
+    if (reclaiming_ || reclaim_suppressed_ > 0) {
+        return false;
+    }
+    reclaiming_ = true;
+    size_t num_freed = 0;
+    for (size_t i = 0; i < num_reclaimers_ && num_freed < num_frames; ++i) {
+        num_freed += reclaimers_[i](num_frames - num_freed);
     }
+    reclaiming_ = false;
+    return num_freed > 0;
+}
+
+Error BitmapMemoryManager::FreeOrder(FrameID start_frame, int order) {
+    if (order < 0 || kMaxFrameOrder < order ||
+        start_frame.ID() % (static_cast<size_t>(1) << order) != 0) {
+        return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+    return Free(start_frame, static_cast<size_t>(1) << order);
 }
 
 void BitmapMemoryManager::SetMemoryRange(FrameID range_begin, FrameID range_end) {
-    range_begin_ = range_begin;
-    range_end_ = range_end;
+    range_begin_ = FrameID{std::min(range_begin.ID(), frame_count_)};
+    range_end_ = FrameID{std::min(range_end.ID(), frame_count_)};
+    free_line_hint_ = range_begin.ID() / kBitsPerMapLine;
+    RebuildFreeBlocks();
 }
 
 MemoryStat BitmapMemoryManager::Stat() const {
@@ -57,7 +215,23 @@ MemoryStat BitmapMemoryManager::Stat() const {
 							i < range_end_.ID() / kBitsPerMapLine; ++i) {
 				sum += std::bitset<kBitsPerMapLine>(alloc_map_[i]).count();
 		}
-		return { sum, range_end_.ID() - range_begin_.ID() };
+
+		MemoryStat stat{ sum, range_end_.ID() - range_begin_.ID(), num_free_blocks_ };
+		size_t frames_in_blocks = 0;
+		for (int order = 1; order <= kMaxFrameOrder; ++order) {
+				frames_in_blocks += num_free_blocks_[order] << order;
+		}
+		const size_t free_frames = stat.total_frames - std::min(stat.total_frames, sum);
+		stat.free_blocks[0] = free_frames - std::min(free_frames, frames_in_blocks);
+		return stat;
+}
+
+size_t BitmapMemoryManager::FreeBlockFrames() const {
+		size_t frames = 0;
+		for (int order = 1; order <= kMaxFrameOrder; ++order) {
+				frames += num_free_blocks_[order] << order;
+		}
+		return frames;
 }
 
 bool BitmapMemoryManager::GetBit(FrameID frame) const {
@@ -76,22 +250,218 @@ void BitmapMemoryManager::SetBit(FrameID frame, bool allocated) {
     } else {
         alloc_map_[line_index] &= ~(static_cast<MapLineType>(1) << bit_index);
     }
+    UpdateFullMap(line_index);
 }
 
-extern "C" caddr_t program_break, program_break_end;
+void BitmapMemoryManager::SetBits(FrameID start_frame, size_t num_frames, bool allocated) {
+    size_t frame = start_frame.ID();
+    const size_t end_frame = std::min<size_t>(frame + num_frames, frame_count_);
+    while (frame < end_frame) {
+        const auto line_index = frame / kBitsPerMapLine;
+        const auto bit_index = frame % kBitsPerMapLine;
+        const auto num_bits = std::min(kBitsPerMapLine - bit_index, end_frame - frame);
+
+        const MapLineType mask = num_bits == kBitsPerMapLine
+            ? kFullLine
+            : ((static_cast<MapLineType>(1) << num_bits) - 1) << bit_index;
+        if (allocated) {
+            alloc_map_[line_index] |= mask;
+        } else {
+            alloc_map_[line_index] &= ~mask;
+        }
+        UpdateFullMap(line_index);
+        frame += num_bits;
+    }
+}
+
+void BitmapMemoryManager::UpdateFullMap(size_t line_index) {
+    const auto full_index = line_index / kBitsPerMapLine;
+    const auto full_bit = static_cast<MapLineType>(1) << (line_index % kBitsPerMapLine);
+    if (alloc_map_[line_index] == kFullLine) {
+        full_map_[full_index] |= full_bit;
+    } else {
+        full_map_[full_index] &= ~full_bit;
+    }
+}
+
+FrameID BitmapMemoryManager::FindFreeFrame(FrameID frame) const {
+    if (frame.ID() >= range_end_.ID()) {
+        return kNullFrame;
+    }
+
+    // search free frames in the line including the given frame
+    auto line_index = frame.ID() / kBitsPerMapLine;
+    const auto bit_index = frame.ID() % kBitsPerMapLine;
+    const MapLineType free_bits = ~alloc_map_[line_index] & (kFullLine << bit_index);
+    if (free_bits != 0) {
+        const auto free_frame = line_index * kBitsPerMapLine + LowestSetBit(free_bits);
+        return free_frame < range_end_.ID() ? FrameID{free_frame} : kNullFrame;
+    }
+
+    // skip fully allocated lines by looking at the summary word by word
+    ++line_index;
+    const auto end_line = (range_end_.ID() + kBitsPerMapLine - 1) / kBitsPerMapLine;
+    while (line_index < end_line) {
+        const auto full_index = line_index / kBitsPerMapLine;
+        const MapLineType not_full =
+            ~full_map_[full_index] & (kFullLine << (line_index % kBitsPerMapLine));
+        if (not_full == 0) {
+            line_index = (full_index + 1) * kBitsPerMapLine;
+            continue;
+        }
+
+        line_index = full_index * kBitsPerMapLine + LowestSetBit(not_full);
+        if (line_index >= end_line) {
+            break;
+        }
+        const auto free_frame =
+            line_index * kBitsPerMapLine + LowestSetBit(~alloc_map_[line_index]);
+        return free_frame < range_end_.ID() ? FrameID{free_frame} : kNullFrame;
+    }
+    return kNullFrame;
+}
+
+size_t BitmapMemoryManager::CountFreeFrames(FrameID frame, size_t max_frames) const {
+    size_t num_free = 0;
+    size_t current = frame.ID();
+    while (num_free < max_frames && current < frame_count_) {
+        const auto line_index = current / kBitsPerMapLine;
+        const auto bit_index = current % kBitsPerMapLine;
+        const MapLineType used_bits = alloc_map_[line_index] >> bit_index;
+        if (used_bits != 0) {
+            // stop at the first allocated frame in this line
+            num_free += LowestSetBit(used_bits);
+            break;
+        }
+        num_free += kBitsPerMapLine - bit_index;
+        current += kBitsPerMapLine - bit_index;
+    }
+    return std::min(num_free, max_frames);
+}
+
+BitmapMemoryManager::MapLineType&
+BitmapMemoryManager::BlockMapLine(int order, size_t block_index) {
+    return free_blocks_[block_map_offset_[order] + block_index / kBitsPerMapLine];
+}
+
+bool BitmapMemoryManager::IsFreeBlock(size_t frame, int order) const {
+    if (frame < range_begin_.ID() || frame + (static_cast<size_t>(1) << order) > range_end_.ID()) {
+        return false;
+    }
+    if (order == 0) {
+        return !GetBit(FrameID{frame});
+    }
+    const size_t block_index = frame >> order;
+    const auto line = free_blocks_[block_map_offset_[order] + block_index / kBitsPerMapLine];
+    return (line >> (block_index % kBitsPerMapLine)) & 1;
+}
+
+void BitmapMemoryManager::AddFreeBlock(size_t frame, int order) {
+    if (order == 0) {
+        return;
+    }
+    const size_t block_index = frame >> order;
+    BlockMapLine(order, block_index) |=
+        static_cast<MapLineType>(1) << (block_index % kBitsPerMapLine);
+    ++num_free_blocks_[order];
+    free_block_hint_[order] =
+        std::min(free_block_hint_[order], block_index / kBitsPerMapLine);
+}
+
+void BitmapMemoryManager::RemoveFreeBlock(size_t frame, int order) {
+    if (order == 0) {
+        return;
+    }
+    const size_t block_index = frame >> order;
+    BlockMapLine(order, block_index) &=
+        ~(static_cast<MapLineType>(1) << (block_index % kBitsPerMapLine));
+    --num_free_blocks_[order];
+}
+
+void BitmapMemoryManager::FreeBlock(size_t frame, int order) {
+    while (order < kMaxFrameOrder) {
+        const size_t buddy = frame ^ (static_cast<size_t>(1) << order);
+        if (!IsFreeBlock(buddy, order)) {
+            break;
+        }
+        RemoveFreeBlock(buddy, order);
+        frame = std::min(frame, buddy);
+        ++order;
+    }
+    AddFreeBlock(frame, order);
+}
+
+void BitmapMemoryManager::AddFreeRange(size_t begin, size_t end) {
+    while (begin < end) {
+        const int order = MaxBlockOrder(begin, end);
+        AddFreeBlock(begin, order);
+        begin += static_cast<size_t>(1) << order;
+    }
+}
+
+void BitmapMemoryManager::CarveFreeBlocks(size_t begin, size_t end) {
+    size_t frame = begin;
+    while (frame < end) {
+        const auto free_frame = FindFreeFrame(FrameID{frame});
+        if (free_frame.ID() == kNullFrame.ID() || free_frame.ID() >= end) {
+            return;
+        }
+        frame = free_frame.ID();
+
+        int order = kMaxFrameOrder;
+        size_t block = 0;
+        for (; order >= 1; --order) {
+            block = frame & ~((static_cast<size_t>(1) << order) - 1);
+            if (IsFreeBlock(block, order)) {
+                break;
+            }
+        }
+        if (order == 0) {
+            // free frame not covered by blocks is a block of order 0 itself
+            ++frame;
+            continue;
+        }
+
+        const size_t block_end = block + (static_cast<size_t>(1) << order);
+        RemoveFreeBlock(block, order);
+        AddFreeRange(block, frame);
+        AddFreeRange(std::min(end, block_end), block_end);
+        frame = std::min(end, block_end);
+    }
+}
+
+void BitmapMemoryManager::RebuildFreeBlocks() {
+    std::fill_n(free_blocks_, block_map_offset_[kMaxFrameOrder + 1], 0);
+    num_free_blocks_.fill(0);
+    free_block_hint_.fill(0);
+
+    auto frame = FindFreeFrame(range_begin_);
+    while (frame.ID() != kNullFrame.ID()) {
+        const size_t num_free = std::min(CountFreeFrames(frame, range_end_.ID() - frame.ID()),
+                                         range_end_.ID() - frame.ID());
+        AddFreeRange(frame.ID(), frame.ID() + num_free);
+        frame = FindFreeFrame(FrameID{frame.ID() + num_free});
+    }
+}
 
 namespace {
     char memory_manager_buf[sizeof(BitmapMemoryManager)];
 
-    Error InitializeHeap(BitmapMemoryManager& memory_manager) {
-        const int kHeapFrames = 64 * 512;
-        const auto heap_start = memory_manager.Allocate(kHeapFrames);
-        if (heap_start.error) {
-            return heap_start.error;
-        }
+    /** @brief FrameRefCount of each frame in [0, num_frame_refs) */
+    FrameRefCount* frame_refs;
+    size_t num_frame_refs;
 
-        program_break = reinterpret_cast<caddr_t>(heap_start.value.ID() * kBytesPerFrame);
-        program_break_end = program_break + kHeapFrames * kBytesPerFrame;
+    /** @brief allocate the reference count array covering frames in [0, num_frames) */
+    Error InitializeFrameRefs(size_t num_frames) {
+        const size_t num_map_frames = (num_frames * sizeof(FrameRefCount) + kBytesPerFrame - 1)
+                                      / kBytesPerFrame;
+        auto [ frame, err ] = memory_manager->Allocate(num_map_frames);
+        if (err) {
+            return err;
+        }
+        frame_refs = reinterpret_cast<FrameRefCount*>(frame.Frame());
+        num_frame_refs = num_frames;
+        memset(frame_refs, 0, num_frames * sizeof(FrameRefCount));
         return MAKE_ERROR(Error::kSuccess);
     }
 }
@@ -99,13 +469,46 @@ namespace {
 BitmapMemoryManager* memory_manager;
 
 void InitializeMemoryManager(const MemoryMap& memory_map) {
-    ::memory_manager = new(memory_manager_buf) BitmapMemoryManager;
-
     const auto memory_map_base = reinterpret_cast<uintptr_t>(memory_map.buffer);
+    const auto memory_map_end = memory_map_base + memory_map.map_size;
+
+    // the bitmaps cover frames up to the end of the highest available memory
     uintptr_t available_end = 0;
-    for (uintptr_t iter = memory_map_base;
-        iter < memory_map_base + memory_map.map_size;
-        iter += memory_map.descriptor_size) {
+    for (uintptr_t iter = memory_map_base; iter < memory_map_end; iter += memory_map.descriptor_size) {
+        auto desc = reinterpret_cast<const MemoryDescriptor*>(iter);
+        if (IsAvailable(static_cast<MemoryType>(desc->type))) {
+            available_end = std::max<uintptr_t>(
+                available_end, desc->physical_start + desc->number_of_pages * kUEFIPageSize);
+        }
+    }
+    const uintptr_t boot_map_end = kBootPageDirectoryCount * 1_GiB;
+    const size_t frame_count = available_end / kBytesPerFrame;
+    const size_t num_map_frames =
+        (BitmapMemoryManager::MapBytes(frame_count) + kBytesPerFrame - 1) / kBytesPerFrame;
+
+    // take the frames for the bitmaps from the first available memory large enough.
+    // frame 0 is never used and the bitmaps must be accessible by the boot-time identity mapping.
+    uintptr_t map_buffer = 0;
+    for (uintptr_t iter = memory_map_base; iter < memory_map_end; iter += memory_map.descriptor_size) {
+        auto desc = reinterpret_cast<const MemoryDescriptor*>(iter);
+        const auto begin = std::max<uintptr_t>(desc->physical_start, kBytesPerFrame);
+        const auto end = desc->physical_start + desc->number_of_pages * kUEFIPageSize;
+        if (IsAvailable(static_cast<MemoryType>(desc->type)) &&
+            begin + num_map_frames * kBytesPerFrame <= std::min(end, boot_map_end)) {
+            map_buffer = begin;
+            break;
+        }
+    }
+    if (map_buffer == 0) {
+        Log(kError, "no memory for the frame bitmaps of %lu frames\n", frame_count);
+        exit(1);
+    }
+
+    ::memory_manager = new(memory_manager_buf) BitmapMemoryManager{
+        frame_count, reinterpret_cast<void*>(map_buffer)};
+
+    available_end = 0;
+    for (uintptr_t iter = memory_map_base; iter < memory_map_end; iter += memory_map.descriptor_size) {
             auto desc = reinterpret_cast<const MemoryDescriptor*>(iter);
             if (available_end < desc->physical_start) {
                 memory_manager->MarkAllocated(
@@ -125,11 +528,107 @@ void InitializeMemoryManager(const MemoryMap& memory_map) {
                 );
             }
     }
-    memory_manager->SetMemoryRange(FrameID{1}, FrameID{available_end / kBytesPerFrame});
+    memory_manager->MarkAllocated(FrameID{map_buffer / kBytesPerFrame}, num_map_frames);
+    // frames beyond the boot-time identity mapping are added by ExtendIdentityMapping
+    memory_manager->SetMemoryRange(
+        FrameID{1}, FrameID{std::min<size_t>(frame_count, boot_map_end / kBytesPerFrame)});
 
-    if (auto err = InitializeHeap(*memory_manager)) {
-        Log(kError, "failed to allocate pages: %s at %s:%d\n",
+    if (auto err = InitializeFrameRefs(frame_count)) {
+        Log(kError, "failed to allocate frame reference counts: %s at %s:%d\n",
             err.Name(), err.File(), err.Line());
         exit(1);
     }
-}
\ No newline at end of file
+}
+
+void ShareFrame(FrameID frame) {
+    InterruptGuard guard;
+    if (frame.ID() < num_frame_refs && frame_refs[frame.ID()] != kPinnedFrame) {
+        // saturate rather than wrap around. Such a frame is leaked but never freed while in use.
+        ++frame_refs[frame.ID()];
+    }
+}
+
+bool IsFrameShared(FrameID frame) {
+    return frame.ID() >= num_frame_refs || frame_refs[frame.ID()] > 0;
+}
+
+FrameRefCount FrameSharers(FrameID frame) {
+    return frame.ID() < num_frame_refs ? frame_refs[frame.ID()] : kPinnedFrame;
+}
+
+void PinFrame(FrameID frame) {
+    if (frame.ID() < num_frame_refs) {
+        frame_refs[frame.ID()] = kPinnedFrame;
+    }
+}
+
+Error ReleaseFrame(FrameID frame, int order) {
+    InterruptGuard guard;
+    if (frame.ID() >= num_frame_refs || frame_refs[frame.ID()] == kPinnedFrame) {
+        return MAKE_ERROR(Error::kSuccess);
+    }
+    if (frame_refs[frame.ID()] > 0) {
+        --frame_refs[frame.ID()];
+        return MAKE_ERROR(Error::kSuccess);
+    }
+    return memory_manager->FreeOrder(frame, order);
+}
+namespace {
+    /** @brief capacity of the zero-filled frame pool (frames) */
+    const size_t kZeroFramePoolSize = 512;
+    /** @brief the pool is not filled when free frames are fewer than this (32 MiB) */
+    const size_t kZeroFramePoolMinFreeFrames = 8192;
+    std::array<size_t, kZeroFramePoolSize> zero_frames;
+    ZeroFramePoolStat zero_frame_pool_stat;
+}
+
+WithError<FrameID> AllocateZeroedFrame() {
+    InterruptGuard guard;
+    auto& stat = zero_frame_pool_stat;
+    if (stat.frames > 0) {
+        ++stat.hits;
+        return { FrameID{zero_frames[--stat.frames]}, MAKE_ERROR(Error::kSuccess) };
+    }
+
+    ++stat.misses;
+    auto frame = memory_manager->Allocate(1);
+    if (frame.error) {
+        return frame;
+    }
+    memset(frame.value.Frame(), 0, kBytesPerFrame);
+    return frame;
+}
+
+bool FillZeroFramePool() {
+    auto& stat = zero_frame_pool_stat;
+    FrameID frame = kNullFrame;
+    {
+        InterruptGuard guard;
+        if (stat.frames >= kZeroFramePoolSize ||
+            memory_manager->FreeBlockFrames() < kZeroFramePoolMinFreeFrames) {
+            return false;
+        }
+        // do not run reclaimers (evicting caches) only to fill the pool
+        auto [ f, err ] = memory_manager->AllocateFrames(1);
+        if (err) {
+            return false;
+        }
+        frame = f;
+    }
+
+    // the frame is owned by nobody else, so zero-filling can be interrupted
+    memset(frame.Frame(), 0, kBytesPerFrame);
+
+    InterruptGuard guard;
+    if (stat.frames >= kZeroFramePoolSize) {
+        memory_manager->Free(frame, 1);
+        return false;
+    }
+    zero_frames[stat.frames++] = frame.ID();
+    return true;
+}
+
+ZeroFramePoolStat GetZeroFramePoolStat() {
+    InterruptGuard guard;
+    return zero_frame_pool_stat;
+}
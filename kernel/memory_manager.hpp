@@ -5,6 +5,7 @@
 #pragma once
 
 #include <array>
+#include <cstdint>
 #include <limits>
 
 #include "error.hpp"
@@ -39,38 +40,66 @@ class FrameID {
 
 static const FrameID kNullFrame{std::numeric_limits<size_t>::max()};
 
+/** @brief max order of blocks managed by buddy system. A block of order k has 2^k frames. */
+const int kMaxFrameOrder = 15;
+
 struct MemoryStat {
 		size_t allocated_frames;
 		size_t total_frames;
+		/** @brief the number of free blocks of each order */
+		std::array<size_t, kMaxFrameOrder + 1> free_blocks;
 };
 
+/** @brief release cached memory when frames run short. return the number of frames freed */
+using MemoryReclaimer = size_t (size_t num_frames);
+
 /** @brief class to manage memories frame by frame via bitmap array. 
 *
 *   manage free frame wvia bitmap (1 bit/frame).
 *   Each bit in the array alloc_map is corresponded to a frame. 0: free / 1: used.
 *   Pysical address corresponded to Bit m of alloc_map[n] is calculated by :
 *       kFrameBytes * (n * kBitsPerMapLine + m)
+*
+*   Free frames are also kept as buddy blocks (2^order frames aligned to their size)
+*   so that AllocateOrder / FreeOrder can find and merge power-of-two runs in O(kMaxFrameOrder).
+*   Free blocks of order 1 ~ kMaxFrameOrder are recorded in free_blocks_ (1 bit/block).
+*   A free frame which is not covered by any of them is a free block of order 0.
 */
+
 class BitmapMemoryManager {
     public:
-        /** @brief max physical memory capacity (bytes) which can be used in this memory manager class */
-        static const auto kMaxPhysicalMemoryBytes{128_GiB};
-        /** @brief the number of required frames to manipulate physical memories of kMaxPhysicalMemoryBytes */
-        static const auto kFrameCount{kMaxPhysicalMemoryBytes / kBytesPerFrame};
-
         /** @brief element type of bitmap array */
         using MapLineType = unsigned long;
         /** @brief num of frame = num of bits of one element in bitmap array */
         static const size_t kBitsPerMapLine{8 * sizeof(MapLineType)};
 
-        /** @brief initialize instance */
-        BitmapMemoryManager();
+        /** @brief bytes of the bitmaps needed to manage frames in [0, frame_count) */
+        static size_t MapBytes(size_t frame_count);
+
+        /** @brief initialize instance managing frames in [0, frame_count). all frames are free.
+        *
+        *   @param map_buffer : MapBytes(frame_count) bytes to place the bitmaps in.
+        *                       It must be kept as long as this instance is used.
+        */
+        BitmapMemoryManager(size_t frame_count, void* map_buffer);
+
+        /** @brief the number of frames managed by this instance */
+        size_t FrameCount() const { return frame_count_; }
 
         /** @brief allocate memories of the given num of frames and return FrameID of the head */
         WithError<FrameID> Allocate(size_t num_frames);
+        /** @brief Allocate without calling reclaimers. for speculative allocation */
+        WithError<FrameID> AllocateFrames(size_t num_frames);
         Error Free(FrameID start_frame, size_t num_frames);
         void MarkAllocated(FrameID start_frame, size_t num_frames);
 
+        /** @brief allocate 2^order frames aligned to 2^order frames by buddy system */
+        WithError<FrameID> AllocateOrder(int order);
+        /** @brief AllocateOrder without calling reclaimers. for an attempt which has a fallback */
+        WithError<FrameID> AllocateBlock(int order);
+        /** @brief free 2^order frames allocated by AllocateOrder, merging with free buddies */
+        Error FreeOrder(FrameID start_frame, int order);
+
         /** @brief set memory range that this memory manager manipulates.
         *   After calling this func, memory allocation by Allocate will be conducted within this range.
         *
@@ -81,17 +110,123 @@ class BitmapMemoryManager {
 
 				/** @brief return the number of unused / all frames */
 				MemoryStat Stat() const;
+				/** @brief free frames in buddy blocks of order 1 or more. a lower bound of free frames in O(kMaxFrameOrder) */
+				size_t FreeBlockFrames() const;
+
+				static const size_t kMaxReclaimers = 4;
+				/** @brief Allocate / AllocateOrder call reclaimers and retry once when no memory fits.
+				*
+				*   Reclaimers are called in the order they are added until enough frames are freed,
+				*   so cheaper ones should be added first. kFull is returned if there are too many.
+				*/
+				Error AddReclaimer(MemoryReclaimer* reclaimer);
+				/** @brief Allocate / AllocateOrder do not call reclaimers until ResumeReclaim.
+				*
+				*   Reclaimers free memory to newlib and slabs, so allocations made inside them
+				*   (heap growth in sbrk) must not re-enter them. Calls may nest.
+				*/
+				void SuppressReclaim() { ++reclaim_suppressed_; }
+				void ResumeReclaim() { --reclaim_suppressed_; }
 
     private:
-        std::array<MapLineType, kFrameCount / kBitsPerMapLine> alloc_map_;
+        /** @brief the number of frames which alloc_map_ covers */
+        size_t frame_count_;
+        /** @brief the number of elements in alloc_map_ */
+        size_t map_line_count_;
+        MapLineType* alloc_map_;
+        /** @brief summary of alloc_map_ (1 bit/map line).
+        *
+        *   Bit m of full_map_[n] is 1 iff alloc_map_[n * kBitsPerMapLine + m] is fully allocated,
+        *   so that Allocate can skip 64 fully allocated lines (4096 frames) by one word.
+        */
+        MapLineType* full_map_;
         /** @brief beginning of memory range that this memory manager manipulates. */
         FrameID range_begin_;
         /** @brief end of memory range that this memory manager manipulates. next frame of the last frame. */
         FrameID range_end_;
+        /** @brief index of map line where searching free frames starts.
+        *   All the lines in [range_begin_, free_line_hint_) are fully allocated.
+        */
+        size_t free_line_hint_;
+        /** @brief free block bitmaps. bit i of order k is 1 iff frames [i * 2^k, (i + 1) * 2^k) are a free block.
+        *   Bitmap of order k (k >= 1) starts from free_blocks_[block_map_offset_[k]].
+        */
+        MapLineType* free_blocks_;
+        /** @brief offset of the bitmap of each order in free_blocks_. [kMaxFrameOrder + 1] is the total length */
+        std::array<size_t, kMaxFrameOrder + 2> block_map_offset_;
+        /** @brief the number of free blocks of each order (order 0 is not counted) */
+        std::array<size_t, kMaxFrameOrder + 1> num_free_blocks_;
+        /** @brief index of the line of each order's bitmap where searching free blocks starts */
+        std::array<size_t, kMaxFrameOrder + 1> free_block_hint_;
+
+				std::array<MemoryReclaimer*, kMaxReclaimers> reclaimers_{};
+				size_t num_reclaimers_{0};
+				bool reclaiming_{false};
+				int reclaim_suppressed_{0};
+
+				/** @brief call reclaimers_ unless they are running. return true if they freed some frames */
+				bool Reclaim(size_t num_frames);
 
         bool GetBit(FrameID frame) const;
         void SetBit(FrameID frame, bool allocated);
+        /** @brief set (allocated = true) or clear bits of [start_frame, start_frame + num_frames) line by line */
+        void SetBits(FrameID start_frame, size_t num_frames, bool allocated);
+        /** @brief reflect the state of alloc_map_[line_index] into full_map_ */
+        void UpdateFullMap(size_t line_index);
+        /** @brief return the first free frame at or after the given frame, or kNullFrame */
+        FrameID FindFreeFrame(FrameID frame) const;
+        /** @brief return the number of successive free frames from the given frame (up to max_frames) */
+        size_t CountFreeFrames(FrameID frame, size_t max_frames) const;
+
+        MapLineType& BlockMapLine(int order, size_t block_index);
+        bool IsFreeBlock(size_t frame, int order) const;
+        void AddFreeBlock(size_t frame, int order);
+        void RemoveFreeBlock(size_t frame, int order);
+        /** @brief register a block whose frames have just been freed, merging with free buddies */
+        void FreeBlock(size_t frame, int order);
+        /** @brief register free frames [begin, end) as blocks without merging with neighbors */
+        void AddFreeRange(size_t begin, size_t end);
+        /** @brief remove frames [begin, end) from free blocks, keeping the rest of split blocks free */
+        void CarveFreeBlocks(size_t begin, size_t end);
+        /** @brief reconstruct free blocks from alloc_map_ within the memory range */
+        void RebuildFreeBlocks();
 };
 
 extern BitmapMemoryManager* memory_manager;
-void InitializeMemoryManager(const MemoryMap& memory_map);
\ No newline at end of file
+void InitializeMemoryManager(const MemoryMap& memory_map);
+
+/** @brief the number of page map entries sharing a frame in addition to its owner.
+*
+*   A newly allocated frame has no sharer (0). The count is kept for the first frame of
+*   a block mapped by a 2 MiB page. kPinnedFrame means the frame is never freed by ReleaseFrame.
+*/
+using FrameRefCount = uint8_t;
+const FrameRefCount kPinnedFrame = std::numeric_limits<FrameRefCount>::max();
+
+/** @brief add a sharer of the frame */
+void ShareFrame(FrameID frame);
+/** @brief return true if the frame has sharers, i.e. someone else still maps it */
+bool IsFrameShared(FrameID frame);
+/** @brief return the number of sharers of the frame, or kPinnedFrame if it is pinned or not counted */
+FrameRefCount FrameSharers(FrameID frame);
+/** @brief make the frame never freed by ReleaseFrame */
+void PinFrame(FrameID frame);
+/** @brief drop a reference to 2^order frames. free them if it was the last reference */
+Error ReleaseFrame(FrameID frame, int order);
+
+struct ZeroFramePoolStat {
+		/** @brief the number of zero-filled frames in the pool */
+		size_t frames;
+		/** @brief the number of AllocateZeroedFrame calls served from / not from the pool */
+		size_t hits, misses;
+};
+
+/** @brief allocate a zero-filled frame.
+*
+*   The frame is taken from the pool filled by FillZeroFramePool if possible.
+*   Otherwise a frame is allocated and zero-filled here.
+*/
+WithError<FrameID> AllocateZeroedFrame();
+/** @brief zero-fill a frame and add it to the pool. return false if the pool is full. */
+bool FillZeroFramePool();
+ZeroFramePoolStat GetZeroFramePoolStat();
\ No newline at end of file
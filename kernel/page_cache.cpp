@@ -0,0 +1,84 @@
+#include "page_cache.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+#include "interrupt.hpp"
+
+WithError<uintptr_t> PageCache::GetPage(FileDescriptor& file, size_t offset) {
+		if (auto resident = file.ResidentPage(offset)) {
+				// writes go to the volume image directly. the frame is pinned so that unmapping never frees it.
+				const auto resident_addr = reinterpret_cast<uintptr_t>(resident);
+				PinFrame(FrameID{resident_addr / kBytesPerFrame});
+				return { resident_addr, MAKE_ERROR(Error::kSuccess) };
+		}
+
+		InterruptGuard guard;
+		auto& pages = files_[file.FileID()];
+		if (auto it = pages.find(offset); it != pages.end()) {
+				ShareFrame(it->second);
+				return { reinterpret_cast<uintptr_t>(it->second.Frame()), MAKE_ERROR(Error::kSuccess) };
+		}
+
+		auto [ frame, err ] = AllocateZeroedFrame();
+		if (err) {
+				return { 0, err };
+		}
+		if (offset < file.Size()) {
+				file.Load(frame.Frame(), std::min<size_t>(kBytesPerFrame, file.Size() - offset), offset);
+		}
+		pages.emplace(offset, frame);
+		++num_pages_;
+		ShareFrame(frame);
+		return { reinterpret_cast<uintptr_t>(frame.Frame()), MAKE_ERROR(Error::kSuccess) };
+}
+
+void PageCache::Update(uint64_t file_id, size_t offset, const void* buf, size_t len) {
+		InterruptGuard guard;
+		auto file_it = files_.find(file_id);
+		if (file_it == files_.end() || len == 0) {
+				return;
+		}
+		const auto buf8 = reinterpret_cast<const uint8_t*>(buf);
+		auto& pages = file_it->second;
+		for (auto it = pages.lower_bound(offset - offset % kBytesPerFrame);
+				 it != pages.end() && it->first < offset + len; ++it) {
+				const size_t begin = std::max(offset, it->first);
+				const size_t end = std::min<size_t>(offset + len, it->first + kBytesPerFrame);
+				// buf may be this very page when a dirty page is written back
+				memmove(reinterpret_cast<uint8_t*>(it->second.Frame()) + (begin - it->first),
+								&buf8[begin - offset], end - begin);
+		}
+}
+
+void PageCache::Prune(FileDescriptor& file) {
+		InterruptGuard guard;
+		auto file_it = files_.find(file.FileID());
+		if (file_it == files_.end()) {
+				return;
+		}
+		auto& pages = file_it->second;
+		for (auto it = pages.begin(); it != pages.end(); ) {
+				if (IsFrameShared(it->second)) {
+						++it;
+						continue;
+				}
+				ReleaseFrame(it->second, 0);
+				it = pages.erase(it);
+				--num_pages_;
+		}
+		if (pages.empty()) {
+				files_.erase(file_it);
+		}
+}
+
+PageCache* page_cache;
+
+namespace {
+		alignas(PageCache) char page_cache_buf[sizeof(PageCache)];
+}
+
+void InitializePageCache() {
+		page_cache = new(page_cache_buf) PageCache;
+}
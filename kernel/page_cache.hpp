@@ -0,0 +1,44 @@
+/*
+* file collecting programs to share pages of files mapped with MAP_FILE_SHARED among tasks
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+
+#include "error.hpp"
+#include "file.hpp"
+#include "memory_manager.hpp"
+
+/** @brief pages of files mapped shared, one frame per file page regardless of the number of mappers.
+*
+*   The cache holds one reference to each frame and every mapping adds a sharer, so a frame
+*   which is not shared any longer is mapped by no one and can be released.
+*   Pages resident in the volume image are mapped as they are and not held here.
+*/
+class PageCache {
+		public:
+				/** @brief return the address of the page at offset of the file with a sharer added for the caller */
+				WithError<uintptr_t> GetPage(FileDescriptor& file, size_t offset);
+				/** @brief copy bytes written to the file at offset into its cached pages.
+				*
+				*   Called wherever the file is written, so that new mappers do not get stale contents and
+				*   writing back a dirty page does not bring back old bytes. Other bytes of the pages,
+				*   which mappers may have modified, are kept.
+				*/
+				void Update(uint64_t file_id, size_t offset, const void* buf, size_t len);
+				/** @brief release pages of the file which no one maps */
+				void Prune(FileDescriptor& file);
+				/** @brief the number of pages held */
+				size_t NumPages() const { return num_pages_; }
+
+		private:
+				/** @brief key: FileDescriptor::FileID, offset */
+				std::map<uint64_t, std::map<size_t, FrameID>> files_{};
+				size_t num_pages_{0};
+};
+
+extern PageCache* page_cache;
+void InitializePageCache();
@@ -0,0 +1,337 @@
+#include "page_merge.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <map>
+
+#include "interrupt.hpp"
+#include "memory_manager.hpp"
+#include "paging.hpp"
+#include "task.hpp"
+#include "timer.hpp"
+
+namespace {
+		/** @brief pages examined per wakeup */
+		const size_t kPagesPerBatch = 256;
+		const unsigned long kBatchInterval = kNanosecondsPerSecond / 5;
+		const size_t kPageBytes = 4096;
+
+		/** @brief a page seen in the current pass. It may be changed or unmapped later */
+		struct Candidate {
+				uint64_t task_id;
+				uint64_t vaddr;
+				FrameID frame = kNullFrame;
+		};
+
+		/** @brief merged frames keyed by the hash of their contents.
+		*
+		*   Each of them has a reference of its own (ShareFrame) so that it is never freed while listed.
+		*/
+		std::map<uint64_t, FrameID>* stable_frames;
+		/** @brief pages seen once in the current pass keyed by the hash of their contents */
+		std::map<uint64_t, Candidate>* unstable_pages;
+		/** @brief private pages found by the page map walk of a batch, examined with interrupts enabled */
+		std::array<Candidate, kPagesPerBatch> batch_pages;
+
+		/** @brief the task slot being scanned, and the ID of the task in it to detect reuse of the slot */
+		size_t cursor_slot = 0;
+		uint64_t cursor_task_id = 0;
+		uint64_t cursor_vaddr = 0;
+		PageMergeStat stat{};
+
+		const void* FrameData(FrameID frame) {
+				return frame.Frame();
+		}
+
+		uint64_t HashPage(const void* page) {
+				// FNV-1a by 64 bit words
+				const auto words = reinterpret_cast<const uint64_t*>(page);
+				uint64_t h = 14695981039346656037ull;
+				for (size_t i = 0; i < kPageBytes / sizeof(uint64_t); ++i) {
+						h = (h ^ words[i]) * 1099511628211ull;
+				}
+				return h;
+		}
+
+		bool IsZeroFilled(const void* page) {
+				const auto words = reinterpret_cast<const uint64_t*>(page);
+				return std::all_of(words, words + kPageBytes / sizeof(uint64_t),
+													 [](uint64_t w) { return w == 0; });
+		}
+
+		/** @brief true if pages of the area are private to the task and may be merged */
+		bool IsMergeable(const VMA& vma) {
+				return vma.writable && !vma.shared &&
+						(vma.type == VMA::kImage || vma.type == VMA::kDemandPaging ||
+						 vma.type == VMA::kStack || vma.type == VMA::kFileMap);
+		}
+
+		/** @brief a private page: writable and mapped by no one else */
+		bool IsPrivatePage(const PageMapEntry* entry, int level) {
+				return entry && level == 1 && entry->bits.present && entry->bits.writable &&
+						!IsFrameShared(FrameID{reinterpret_cast<uintptr_t>(entry->Pointer()) / kBytesPerFrame});
+		}
+
+		/** @brief the entry of a page if it still maps the frame only for the task. call with interrupts disabled.
+		*
+		*   Returns nullptr also while the kernel may be about to write to the page for a syscall of the task.
+		*/
+		PageMapEntry* FindPage(const Candidate& page, Task*& task) {
+				task = task_manager->FindTask(page.task_id);
+				if (task == nullptr || task->PendingUserWrites() > 0) {
+						return nullptr;
+				}
+				int level;
+				auto entry = FindLeafEntry(PML4OfCR3(task->Context().cr3),
+																	 LinearAddress4Level{page.vaddr}, level);
+				if (entry == nullptr || level != 1 || !entry->bits.present ||
+						reinterpret_cast<uintptr_t>(entry->Pointer()) !=
+								reinterpret_cast<uintptr_t>(page.frame.Frame()) ||
+						IsFrameShared(page.frame)) {
+						return nullptr;
+				}
+				return entry;
+		}
+
+		/** @brief make a private page read-only so that its contents can be compared with interrupts enabled.
+		*
+		*   Writing to the page afterwards makes it writable again (or maps a copy) through the fault,
+		*   which WriteProtected detects.
+		*/
+		bool WriteProtect(const Candidate& page) {
+				InterruptGuard guard;
+				Task* task;
+				auto entry = FindPage(page, task);
+				if (entry == nullptr || !entry->bits.writable) {
+						return false;
+				}
+				entry->bits.writable = 0;
+				task->Context().cr3 |= kCR3FlushOnRestore;
+				return true;
+		}
+
+		/** @brief the entry of a page made read-only by WriteProtect if it has not been written since */
+		PageMapEntry* WriteProtected(const Candidate& page, Task*& task) {
+				auto entry = FindPage(page, task);
+				return entry && !entry->bits.writable ? entry : nullptr;
+		}
+
+		/** @brief map a page read-only to a frame of the same contents and release the frame it mapped.
+		*
+		*   return false if the page changed.
+		*/
+		bool MergeInto(const Candidate& page, uintptr_t frame_addr) {
+				if (!WriteProtect(page) ||
+						memcmp(FrameData(page.frame), reinterpret_cast<const void*>(frame_addr), kPageBytes) != 0) {
+						return false;
+				}
+				InterruptGuard guard;
+				Task* task;
+				auto entry = WriteProtected(page, task);
+				if (entry == nullptr) {
+						return false;
+				}
+				ShareFrame(FrameID{frame_addr / kBytesPerFrame});
+				entry->SetPointer(reinterpret_cast<PageMapEntry*>(frame_addr));
+				task->Context().cr3 |= kCR3FlushOnRestore;
+				ReleaseFrame(page.frame, 0);
+				return true;
+		}
+
+		/** @brief make the frame of a candidate page read-only and list it as a merged frame.
+		*
+		*   return false if the page changed since it was seen.
+		*/
+		bool Stabilize(uint64_t hash, const Candidate& candidate, const void* contents) {
+				if (!WriteProtect(candidate) ||
+						memcmp(FrameData(candidate.frame), contents, kPageBytes) != 0) {
+						return false;
+				}
+				{
+						InterruptGuard guard;
+						Task* task;
+						if (WriteProtected(candidate, task) == nullptr) {
+								return false;
+						}
+						ShareFrame(candidate.frame); // the reference of stable_frames
+				}
+				stable_frames->emplace(hash, candidate.frame);
+				return true;
+		}
+
+		void ScanPage(const Candidate& page) {
+				++stat.pages_scanned;
+				const void* contents = FrameData(page.frame);
+
+				if (IsZeroFilled(contents)) {
+						if (MergeInto(page, ZeroPageAddress())) {
+								++stat.zero_pages;
+						}
+						return;
+				}
+
+				const uint64_t hash = HashPage(contents);
+				if (auto it = stable_frames->find(hash); it != stable_frames->end()) {
+						// a different page of the same hash is just left
+						if (MergeInto(page, reinterpret_cast<uintptr_t>(it->second.Frame()))) {
+								++stat.merges;
+						}
+						return;
+				}
+
+				if (auto it = unstable_pages->find(hash); it != unstable_pages->end()) {
+						const Candidate candidate = it->second;
+						unstable_pages->erase(it);
+						if (candidate.frame.ID() != page.frame.ID() && Stabilize(hash, candidate, contents)) {
+								if (MergeInto(page, reinterpret_cast<uintptr_t>(candidate.frame.Frame()))) {
+										++stat.merges;
+								}
+								return;
+						}
+				}
+				unstable_pages->insert_or_assign(hash, page);
+		}
+
+		/** @brief collect private pages of the task from cursor_vaddr into batch_pages.
+		*
+		*   return false when the task is done. call with interrupts disabled.
+		*/
+		bool ScanTask(Task& task, size_t& budget, size_t& num_pages) {
+				if (task.PendingUserWrites() > 0) {
+						// a syscall prepared its pages for kernel writes. scan them in the next pass.
+						return false;
+				}
+				const auto pml4 = PML4OfCR3(task.Context().cr3);
+				for (const auto& [ begin, vma ] : task.AddrSpace().Areas()) {
+						if (!IsMergeable(vma) || vma.begin + vma.size <= cursor_vaddr) {
+								continue;
+						}
+						uint64_t page = std::max(vma.begin, cursor_vaddr);
+						while (page < vma.begin + vma.size) {
+								if (budget == 0) {
+										cursor_vaddr = page;
+										return true;
+								}
+								--budget;
+
+								int level;
+								auto entry = FindLeafEntry(pml4, LinearAddress4Level{page}, level);
+								if (entry == nullptr || level > 1) {
+										// skip the whole range of the missing page map or the 2 MiB page
+										const uint64_t skip = kPageBytes << (9 * (level - 1));
+										page = (page & ~(skip - 1)) + skip;
+										continue;
+								}
+								if (IsPrivatePage(entry, level)) {
+										const FrameID frame{reinterpret_cast<uintptr_t>(entry->Pointer()) / kBytesPerFrame};
+										batch_pages[num_pages++] = Candidate{task.ID(), page, frame};
+								}
+								page += kPageBytes;
+						}
+				}
+				return false;
+		}
+
+		/** @brief release merged frames which are not mapped any longer */
+		void PruneStableFrames() {
+				for (auto it = stable_frames->begin(); it != stable_frames->end(); ) {
+						if (IsFrameShared(it->second)) {
+								++it;
+								continue;
+						}
+						ReleaseFrame(it->second, 0);
+						it = stable_frames->erase(it);
+				}
+		}
+
+		/** @brief count merged frames and the frames saved for GetPageMergeStat */
+		void CountMergedFrames() {
+				size_t frames_saved = 0;
+				for (const auto& [ hash, frame ] : *stable_frames) {
+						// sharers include the reference of stable_frames, the owner is not counted
+						const auto sharers = FrameSharers(frame);
+						if (sharers != kPinnedFrame && sharers > 0) {
+								frames_saved += sharers - 1;
+						}
+				}
+				InterruptGuard guard;
+				stat.merged_frames = stable_frames->size();
+				stat.frames_saved = frames_saved;
+		}
+
+		void ScanBatch() {
+				size_t budget = kPagesPerBatch;
+				size_t num_pages = 0;
+				bool suspended = false;
+				{
+						// page maps of other tasks must not change during the walk
+						InterruptGuard guard;
+						task_manager->ForEachTask([&](Task& task, size_t slot) {
+								if (suspended) {
+										return;
+								}
+								if (slot != cursor_slot || task.ID() != cursor_task_id) {
+										cursor_slot = slot;
+										cursor_task_id = task.ID();
+										cursor_vaddr = 0;
+								}
+								suspended = ScanTask(task, budget, num_pages);
+						}, cursor_slot);
+				}
+
+				// hashing and comparing pages can be interrupted. each page is checked again before remapping.
+				for (size_t i = 0; i < num_pages; ++i) {
+						ScanPage(batch_pages[i]);
+				}
+
+				if (!suspended) {
+						// a pass over all the tasks is done
+						cursor_slot = 0;
+						cursor_task_id = 0;
+						cursor_vaddr = 0;
+						unstable_pages->clear();
+						PruneStableFrames();
+						++stat.full_scans;
+				}
+				CountMergedFrames();
+		}
+}
+
+PageMergeStat GetPageMergeStat() {
+		InterruptGuard guard;
+		return stat;
+}
+
+void TaskPageMerge(uint64_t task_id, int64_t data) {
+		Task& task = task_manager->CurrentTask();
+		stable_frames = new std::map<uint64_t, FrameID>;
+		unstable_pages = new std::map<uint64_t, Candidate>;
+		{
+				InterruptGuard guard;
+				timer_manager->AddTimer(Timer{CurrentNanoseconds() + kBatchInterval, 1, task_id});
+		}
+
+		while (true) {
+				__asm__("cli");
+				auto msg = task.ReceiveMessage();
+				if (!msg) {
+						task.Sleep();
+						__asm__("sti");
+						continue;
+				}
+				__asm__("sti");
+
+				if (msg->type == Message::kTimerTimeout) {
+						ScanBatch();
+						InterruptGuard guard;
+						timer_manager->AddTimer(
+								Timer{msg->arg.timer.timeout + kBatchInterval, 1, task_id});
+				}
+		}
+}
+
+void InitializePageMerge() {
+		Task& task = task_manager->NewTask().InitContext(TaskPageMerge, 0);
+		task_manager->Wakeup(&task, 0);
+}
@@ -0,0 +1,32 @@
+/*
+* file collecting programs to merge identical pages of applications (same-page merging)
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+struct PageMergeStat {
+		/** @brief frames which pages are merged into, counted at the end of the last batch */
+		size_t merged_frames;
+		/** @brief frames saved at the end of the last batch: pages mapping the merged frames minus the frames */
+		size_t frames_saved;
+		/** @brief merges so far: pages whose frames were released */
+		size_t merges;
+		/** @brief zero-filled pages remapped to the zero page so far */
+		size_t zero_pages;
+		/** @brief pages examined and passes over all the tasks */
+		size_t pages_scanned, full_scans;
+};
+
+PageMergeStat GetPageMergeStat();
+
+/** @brief a low priority task which merges private pages of the same contents into one read-only frame.
+*
+*   Writing to a merged page copies it again through the copy-on-write fault.
+*/
+void TaskPageMerge(uint64_t task_id, int64_t data);
+
+/** @brief start TaskPageMerge at the lowest level */
+void InitializePageMerge();
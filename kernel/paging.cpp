@@ -1,9 +1,14 @@
 #include "paging.hpp"
 
+#include <algorithm>
 #include <array>
+#include <bitset>
 
 #include "asmfunc.h"
+#include "interrupt.hpp"
 #include "memory_manager.hpp"
+#include "page_cache.hpp"
+#include "swap.hpp"
 #include "task.hpp"
 
 #include "logger.hpp"
@@ -12,32 +17,213 @@ namespace {
     const uint64_t kPageSize4K = 4096;
     const uint64_t kPageSize2M = 512 * kPageSize4K;
     const uint64_t kPageSize1G = 512 * kPageSize2M;
+    /** @brief a 2 MiB page consists of 2^kPageOrder2M frames */
+    const int kPageOrder2M = 9;
 
     alignas(kPageSize4K) std::array<uint64_t, 512> pml4_table;
     alignas(kPageSize4K) std::array<uint64_t, 512> pdp_table;
+    /** @brief page directories mapping the first kBootPageDirectoryCount GiB by 2 MiB pages */
     alignas(kPageSize4K)
-        std::array<std::array<uint64_t, 512>, kPageDirectoryCount> page_directory;
+        std::array<std::array<uint64_t, 512>, kBootPageDirectoryCount> page_directory;
+
+    /** @brief the identity mapping covers [0, identity_map_end) */
+    uint64_t identity_map_end = 0;
+    /** @brief true if the identity mapping is made of 1 GiB pages */
+    bool use_1g_pages = false;
+
+    const uint64_t kCR4PGE = 1u << 7;
+    const uint64_t kCR4PCIDE = 1u << 17;
+    const uint32_t kCPUIDPCID = 1u << 17; // CPUID.01H:ECX
+    const uint32_t kCPUIDPage1GB = 1u << 26; // CPUID.80000001H:EDX
+    const uint64_t kCR3PCIDMask = 0xfff;
+
+    /** @brief CleanPageMaps flushes the whole TLB instead of invalidating more pages than this */
+    const size_t kMaxInvalidatePages = 32;
+
+    /** @brief the frame mapped read-only to demand paging pages which are read before written */
+    alignas(kPageSize4K) std::array<uint8_t, kPageSize4K> zero_page{};
+
+    /** @brief marks a not-present page table entry holding a SwapStore slot ID from bit 12 */
+    const uint64_t kSwapEntryFlag = 1u << 9;
+
+    bool IsSwapEntry(const PageMapEntry& entry) {
+        return !entry.bits.present && (entry.data & kSwapEntryFlag);
+    }
+
+    /** @brief where SwapOutColdPages resumes scanning: the task slot, the ID of the task in it
+    *   to detect reuse of the slot, and the address in the task */
+    size_t swap_cursor_slot = 0;
+    uint64_t swap_cursor_task_id = 0;
+    uint64_t swap_cursor_vaddr = 0;
+
+    /** @brief PCIDs in use. PCID 0 is used by the kernel page map. */
+    std::bitset<4096> pcid_used{1};
+    size_t pcid_hint = 1;
+
+    /** @brief extend the identity mapping to cover [0, end), rounded up to 1 GiB and up to 512 GiB */
+    Error MapIdentityUpTo(uint64_t end) {
+        const size_t num_pdpt = std::min<uint64_t>((end + kPageSize1G - 1) / kPageSize1G,
+                                                  pdp_table.size());
+        const size_t first_pdpt = identity_map_end / kPageSize1G;
+        if (num_pdpt <= first_pdpt) {
+            return MAKE_ERROR(Error::kSuccess);
+        }
+
+        if (use_1g_pages) {
+            for (size_t i_pdpt = first_pdpt; i_pdpt < num_pdpt; ++i_pdpt) {
+                pdp_table[i_pdpt] = i_pdpt * kPageSize1G | 0x183;
+            }
+            identity_map_end = num_pdpt * kPageSize1G;
+            return MAKE_ERROR(Error::kSuccess);
+        }
+
+        // the new page directories must be reachable through the current mapping
+        const size_t num_dirs = num_pdpt - first_pdpt;
+        auto [ frame, err ] = memory_manager->Allocate(num_dirs);
+        if (err) {
+            return err;
+        }
+        if (reinterpret_cast<uint64_t>(frame.Frame()) + num_dirs * kPageSize4K > identity_map_end) {
+            memory_manager->Free(frame, num_dirs);
+            return MAKE_ERROR(Error::kNoEnoughMemory);
+        }
+        auto dirs = reinterpret_cast<std::array<uint64_t, 512>*>(frame.Frame());
+        for (size_t i = 0; i < num_dirs; ++i) {
+            const uint64_t base = (first_pdpt + i) * kPageSize1G;
+            for (int i_pd = 0; i_pd < 512; ++i_pd) {
+                dirs[i][i_pd] = base + i_pd * kPageSize2M | 0x183;
+            }
+            pdp_table[first_pdpt + i] = reinterpret_cast<uint64_t>(&dirs[i]) | 0x003;
+        }
+        identity_map_end = num_pdpt * kPageSize1G;
+        return MAKE_ERROR(Error::kSuccess);
+    }
 }
 
+/** @brief OR-ed to CR3 on context switches. bit 63 (keep TLB entries of the PCID) if PCID is enabled. */
+extern "C" uint64_t cr3_no_flush = 0;
+
 void SetupIdentityPageTable() {
+    uint32_t regs[4];
+    ReadCPUID(0x80000000, 0, regs);
+    if (regs[0] >= 0x80000001) {
+        ReadCPUID(0x80000001, 0, regs);
+        use_1g_pages = regs[3] & kCPUIDPage1GB;
+    }
+
     pml4_table[0] = reinterpret_cast<uint64_t>(&pdp_table[0]) | 0x003;
     for (int i_pdpt = 0; i_pdpt < page_directory.size(); ++i_pdpt) {
+        if (use_1g_pages) {
+            // global (0x100): the identity mapping is the same in every page map
+            pdp_table[i_pdpt] = i_pdpt * kPageSize1G | 0x183;
+            continue;
+        }
         pdp_table[i_pdpt] = reinterpret_cast<uint64_t>(&page_directory[i_pdpt]) | 0x003;
         for (int i_pd = 0; i_pd < 512; ++i_pd) {
-            page_directory[i_pdpt][i_pd] = i_pdpt * kPageSize1G + i_pd * kPageSize2M | 0x083;
+            page_directory[i_pdpt][i_pd] = i_pdpt * kPageSize1G + i_pd * kPageSize2M | 0x183;
         }
     }
+    identity_map_end = page_directory.size() * kPageSize1G;
 
-		ResetCR3();
+		SetCR3(reinterpret_cast<uint64_t>(&pml4_table[0]));
 		SetCR0(GetCR0() & 0xfffeffff); // Clear WP
 }
 
+void ExtendIdentityMapping(const MemoryMap& memory_map) {
+		const auto memory_map_base = reinterpret_cast<uintptr_t>(memory_map.buffer);
+		uint64_t physical_end = kMinIdentityMapBytes;
+		for (uintptr_t iter = memory_map_base;
+		     iter < memory_map_base + memory_map.map_size;
+		     iter += memory_map.descriptor_size) {
+				auto desc = reinterpret_cast<const MemoryDescriptor*>(iter);
+				physical_end = std::max<uint64_t>(
+						physical_end, desc->physical_start + desc->number_of_pages * kUEFIPageSize);
+		}
+
+		if (auto err = MapIdentityUpTo(physical_end)) {
+				Log(kWarn, "failed to extend the identity mapping: %s at %s:%d\n",
+				    err.Name(), err.File(), err.Line());
+		}
+		Log(kInfo, "identity mapping: %lu GiB by %s pages\n",
+		    identity_map_end / kPageSize1G, use_1g_pages ? "1 GiB" : "2 MiB");
+
+		// frames out of the identity mapping cannot be accessed by the kernel
+		memory_manager->SetMemoryRange(
+				FrameID{1},
+				FrameID{std::min<size_t>(memory_manager->FrameCount(), identity_map_end / kBytesPerFrame)});
+}
+
 void InitializePaging() {
     SetupIdentityPageTable();
+
+		uint32_t regs[4];
+		ReadCPUID(1, 0, regs);
+		const bool pcid_supported = regs[2] & kCPUIDPCID;
+
+		// clearing PGE once flushes global entries which the firmware may have left
+		const uint64_t cr4 = GetCR4();
+		SetCR4(cr4 & ~kCR4PGE);
+		SetCR4(cr4 | kCR4PGE | (pcid_supported ? kCR4PCIDE : 0));
+		if (pcid_supported) {
+				cr3_no_flush = 1ull << 63;
+		}
 }
 
 void ResetCR3() {
-		SetCR3(reinterpret_cast<uint64_t>(&pml4_table[0]));
+		SetCR3(reinterpret_cast<uint64_t>(&pml4_table[0]) | cr3_no_flush);
+}
+
+PageMapEntry* CurrentPML4() {
+		return reinterpret_cast<PageMapEntry*>(GetCR3() & ~kCR3PCIDMask);
+}
+
+PageMapEntry* PML4OfCR3(uint64_t cr3) {
+		return reinterpret_cast<PageMapEntry*>(cr3 & ~(kCR3PCIDMask | kCR3FlushOnRestore));
+}
+
+PageMapEntry* FindLeafEntry(PageMapEntry* pml4, LinearAddress4Level addr, int& level) {
+		auto page_map = pml4;
+		for (level = 4; level > 1; --level) {
+				auto& entry = page_map[addr.Part(level)];
+				if (!entry.bits.present) {
+						return nullptr;
+				}
+				if (level == 2 && entry.bits.huge_page) {
+						return &entry;
+				}
+				page_map = entry.Pointer();
+		}
+		return &page_map[addr.Part(1)];
+}
+
+uintptr_t ZeroPageAddress() {
+		const auto addr = reinterpret_cast<uintptr_t>(zero_page.data());
+		// mapping it must never free it
+		PinFrame(FrameID{addr / kBytesPerFrame});
+		return addr;
+}
+
+WithError<uint64_t> NewCR3(PageMapEntry* pml4) {
+		const auto pml4_addr = reinterpret_cast<uint64_t>(pml4);
+		if (cr3_no_flush == 0) {
+				return { pml4_addr, MAKE_ERROR(Error::kSuccess) };
+		}
+
+		for (size_t i = 0; i < pcid_used.size(); ++i) {
+				const size_t pcid = (pcid_hint + i) % pcid_used.size();
+				if (!pcid_used[pcid]) {
+						pcid_used[pcid] = true;
+						pcid_hint = pcid + 1;
+						return { pml4_addr | pcid, MAKE_ERROR(Error::kSuccess) };
+				}
+		}
+		return { 0, MAKE_ERROR(Error::kFull) };
+}
+
+void FreeCR3(uint64_t cr3) {
+		if (const auto pcid = cr3 & kCR3PCIDMask; pcid != 0) {
+				pcid_used[pcid] = false;
+		}
 }
 
 namespace {
@@ -57,30 +243,64 @@ namespace {
         return { child_map, MAKE_ERROR(Error::kSuccess) };
     }
 
+		/** @brief map a zero-filled 2 MiB page by the given page directory entry.
+		*
+		*		return false if the entry is already used or there is no free 2 MiB block.
+		*/
+		bool SetHugePage(PageMapEntry& entry, bool writable) {
+				if (entry.bits.present) {
+						return false;
+				}
+				// callers fall back to 4 KiB pages. evicting caches or swapping out pages
+				// rarely makes a 2 MiB block, so do not run reclaimers for it.
+				auto [ frame, err ] = memory_manager->AllocateBlock(kPageOrder2M);
+				if (err) {
+						return false;
+				}
+				memset(frame.Frame(), 0, kPageSize2M);
+
+				entry.data = 0;
+				entry.SetPointer(reinterpret_cast<PageMapEntry*>(frame.Frame()));
+				entry.bits.present = 1;
+				entry.bits.writable = writable;
+				entry.bits.user = 1;
+				entry.bits.huge_page = 1;
+				return true;
+		}
+
     WithError<size_t> SetupPageMap(
             PageMapEntry* page_map, int page_map_level, LinearAddress4Level addr,
 						size_t num_4kpages, bool writable) {
         while (num_4kpages > 0) {
             const auto entry_index = addr.Part(page_map_level);
+						auto& entry = page_map[entry_index];
 
-						auto [ child_map, err ] = SetNewPageMapIfNotPresent(page_map[entry_index]);
-            if (err) {
-                return { num_4kpages, err };
-            }
-						page_map[entry_index].bits.user = 1;
-
-            if (page_map_level == 1) {
-								page_map[entry_index].bits.writable = writable;
-                --num_4kpages;
-            } else {
-								page_map[entry_index].bits.writable = true;
-                auto [ num_remain_pages, err ] =
-                    SetupPageMap(child_map, page_map_level - 1, addr, num_4kpages, writable);
-                if (err) {
-                    return { num_4kpages, err };
-                }
-                num_4kpages = num_remain_pages;
-            }
+						if (page_map_level == 2 && entry.bits.present && entry.bits.huge_page) {
+								// already mapped by a 2 MiB page
+								num_4kpages -= std::min<size_t>(num_4kpages, 512 - addr.parts.page);
+						} else if (page_map_level == 2 && addr.parts.page == 0 && num_4kpages >= 512 &&
+											 SetHugePage(entry, writable)) {
+								num_4kpages -= 512;
+						} else {
+								auto [ child_map, err ] = SetNewPageMapIfNotPresent(entry);
+								if (err) {
+										return { num_4kpages, err };
+								}
+								entry.bits.user = 1;
+
+								if (page_map_level == 1) {
+										entry.bits.writable = writable;
+										--num_4kpages;
+								} else {
+										entry.bits.writable = true;
+										auto [ num_remain_pages, err ] =
+												SetupPageMap(child_map, page_map_level - 1, addr, num_4kpages, writable);
+										if (err) {
+												return { num_4kpages, err };
+										}
+										num_4kpages = num_remain_pages;
+								}
+						}
 
             if (entry_index == 511) {
                 break;
@@ -95,91 +315,399 @@ namespace {
         return { num_4kpages, MAKE_ERROR(Error::kSuccess) };
     }
 
-		Error CleanPageMap(
-						PageMapEntry* page_map, int page_map_level, LinearAddress4Level addr) {
-        for (int i = addr.Part(page_map_level); i < 512; ++i) {
-            auto entry = page_map[i];
-            if (!entry.bits.present) {
-                continue;
-            }
+		/** @brief replace a 2 MiB page at region with a page table of 512 4 KiB pages of the same contents.
+		*
+		*		A shared page is copied first, so that its frames can be released one by one.
+		*/
+		Error SplitHugePage(PageMapEntry& entry, uint64_t region) {
+				const auto entry_addr = reinterpret_cast<uintptr_t>(entry.Pointer());
+				FrameID frame{entry_addr / kBytesPerFrame};
+				if (IsFrameShared(frame)) {
+						auto [ copy, err ] = memory_manager->AllocateOrder(kPageOrder2M);
+						if (err) {
+								return err;
+						}
+						memcpy(copy.Frame(), reinterpret_cast<const void*>(region), kPageSize2M);
+						if (auto err = ReleaseFrame(frame, kPageOrder2M)) {
+								return err;
+						}
+						frame = copy;
+				}
 
-            if (page_map_level > 1) {
-                if (auto err = CleanPageMap(entry.Pointer(), page_map_level - 1, addr)) {
-                    return err;
-                }
-            }
+				auto [ table, err ] = NewPageMap();
+				if (err) {
+						return err;
+				}
+				PageMapEntry page = entry;
+				page.bits.huge_page = 0;
+				for (int i = 0; i < 512; ++i) {
+						page.SetPointer(reinterpret_cast<PageMapEntry*>(
+								reinterpret_cast<uintptr_t>(frame.Frame()) + i * kPageSize4K));
+						table[i] = page;
+				}
+
+				entry.bits.huge_page = 0;
+				entry.bits.writable = 1;
+				entry.SetPointer(table);
+				InvalidateTLB(region);
+				return MAKE_ERROR(Error::kSuccess);
+		}
+
+		/** @brief unmap pages in [begin, last] under page_map and release their frames.
+		*
+		*		last is inclusive so that a range may reach the end of the address space.
+		*		Page maps which become empty are freed. A 2 MiB page partially in the range is
+		*		split into 4 KiB pages. TLB entries are invalidated page by page if invalidate is true.
+		*/
+		Error CleanPageMap(PageMapEntry* page_map, int page_map_level,
+											 uint64_t begin, uint64_t last, bool invalidate) {
+				const uint64_t entry_bytes = kPageSize4K << (9 * (page_map_level - 1));
+				uint64_t addr = begin;
+				while (true) {
+						const uint64_t entry_begin = addr & ~(entry_bytes - 1);
+						const uint64_t entry_last = entry_begin + (entry_bytes - 1);
+						auto& entry = page_map[LinearAddress4Level{addr}.Part(page_map_level)];
+						bool huge = page_map_level == 2 && entry.bits.huge_page;
+						const bool whole = addr == entry_begin && entry_last <= last;
+						if (entry.bits.present && huge && !whole) {
+								if (auto err = SplitHugePage(entry, entry_begin)) {
+										return err;
+								}
+								huge = false;
+						}
 
-						if (entry.bits.writable) {
+						if (IsSwapEntry(entry)) {
+								swap_store->Free(entry.data >> 12);
+								entry.data = 0;
+						} else if (!entry.bits.present) {
+								// nothing to do
+						} else if (page_map_level > 1 && !huge) {
+								auto child_map = entry.Pointer();
+								if (auto err = CleanPageMap(child_map, page_map_level - 1,
+																				 addr, std::min(last, entry_last), invalidate)) {
+										return err;
+								}
+								if (std::all_of(child_map, child_map + 512,
+																[](const PageMapEntry& e) { return e.data == 0; })) {
+										entry.data = 0;
+										if (auto err = FreePageMap(child_map)) {
+												return err;
+										}
+								}
+						} else if (whole) {
+								// a page may be shared with other page maps by CopyPageMaps
 								const auto entry_addr = reinterpret_cast<uintptr_t>(entry.Pointer());
-								const FrameID map_frame{entry_addr / kBytesPerFrame};
-								if (auto err = memory_manager->Free(map_frame, 1)) {
+								const FrameID frame{entry_addr / kBytesPerFrame};
+								entry.data = 0;
+								if (invalidate) {
+										InvalidateTLB(entry_begin);
+								}
+								if (auto err = ReleaseFrame(frame, huge ? kPageOrder2M : 0)) {
 										return err;
 								}
 						}
-            page_map[i].data = 0;
-        }
 
-        return MAKE_ERROR(Error::kSuccess);
-    }
+						if (entry_last >= last) {
+								break;
+						}
+						addr = entry_last + 1;
+				}
+				return MAKE_ERROR(Error::kSuccess);
+		}
 
-		const FileMapping* FindFileMapping(const std::vector<FileMapping>& fmaps,
-																				uint64_t causal_vaddr) {
-				for (const FileMapping& m : fmaps) {
-						if (m.vaddr_begin <= causal_vaddr && causal_vaddr < m.vaddr_end) {
-								return &m;
+		/** @brief map a 2 MiB page to the 2 MiB region including vaddr in the current page map
+		*		if the whole region is within the area.
+		*
+		*		return false if it is not mapped. The caller should map a 4 KiB page instead.
+		*/
+		bool SetupHugePageIfFit(uint64_t vaddr, const VMA& vma) {
+				const uint64_t region = vaddr & ~(kPageSize2M - 1);
+				if (region < vma.begin || vma.size < (region - vma.begin) + kPageSize2M) {
+						return false;
+				}
+
+				const LinearAddress4Level addr{region};
+				auto page_map = CurrentPML4();
+				for (int level = 4; level > 2; --level) {
+						auto& entry = page_map[addr.Part(level)];
+						auto [ child_map, err ] = SetNewPageMapIfNotPresent(entry);
+						if (err) {
+								return false;
 						}
+						entry.bits.user = 1;
+						entry.bits.writable = 1;
+						page_map = child_map;
 				}
-				return nullptr;
+				return SetHugePage(page_map[addr.Part(2)], true);
 		}
 
-		Error PreparePageCache(FileDescriptor& fd, const FileMapping& m,
-														uint64_t causal_vaddr) {
-				LinearAddress4Level page_vaddr{causal_vaddr};
-				page_vaddr.parts.offset = 0;
-				if (auto err = SetupPageMaps(page_vaddr, 1)) {
-						return err;
+		/** @brief return the page table (level 1) for addr in the current page map, creating page maps if needed.
+		*
+		*		nullptr is returned if addr is in a 2 MiB page.
+		*/
+		WithError<PageMapEntry*> PageTableOf(LinearAddress4Level addr) {
+				auto page_map = CurrentPML4();
+				for (int level = 4; level > 1; --level) {
+						auto& entry = page_map[addr.Part(level)];
+						if (level == 2 && entry.bits.present && entry.bits.huge_page) {
+								return { nullptr, MAKE_ERROR(Error::kSuccess) };
+						}
+						auto [ child_map, err ] = SetNewPageMapIfNotPresent(entry);
+						if (err) {
+								return { nullptr, err };
+						}
+						entry.bits.user = 1;
+						entry.bits.writable = 1;
+						page_map = child_map;
 				}
+				return { page_map, MAKE_ERROR(Error::kSuccess) };
+		}
 
-				const long file_offset = page_vaddr.value - m.vaddr_begin;
-				void* page_cache = reinterpret_cast<void*>(page_vaddr.value);
-				fd.Load(page_cache, 4096, file_offset);
-				return MAKE_ERROR(Error::kSuccess);
+		/** @brief call fill(vaddr, entry) for not-present pages in [addr, addr + num_4kpages * 4 KiB)
+		*		until it returns false, and return the number of pages filled.
+		*
+		*		Page maps are walked once per page table rather than once per page. No TLB entry
+		*		needs to be invalidated because not-present entries are never cached.
+		*/
+		template <class F>
+		size_t FillAbsentPages(LinearAddress4Level addr, size_t num_4kpages, F fill) {
+				size_t num_filled = 0;
+				PageMapEntry* table = nullptr;
+				for (size_t i = 0; i < num_4kpages; ++i, addr.value += kPageSize4K) {
+						if (i == 0 || addr.parts.page == 0) {
+								auto [ t, err ] = PageTableOf(addr);
+								if (err) {
+										break;
+								}
+								table = t;
+						}
+						if (table == nullptr || table[addr.parts.page].bits.present ||
+								IsSwapEntry(table[addr.parts.page])) {
+								continue;
+						}
+						if (!fill(addr.value, table[addr.parts.page])) {
+								break;
+						}
+						++num_filled;
+				}
+				return num_filled;
 		}
 
-		Error SetPageContent(PageMapEntry* table, int part,
-													LinearAddress4Level addr, PageMapEntry* content) {
-				if (part == 1) {
-						const auto i = addr.Part(part);
-						table[i].SetPointer(content);
-						table[i].bits.writable = 1;
-						InvalidateTLB(addr.value);
-						return MAKE_ERROR(Error::kSuccess);
+		void SetPageEntry(PageMapEntry& entry, uintptr_t frame_addr, bool writable) {
+				entry.data = 0;
+				entry.SetPointer(reinterpret_cast<PageMapEntry*>(frame_addr));
+				entry.bits.present = 1;
+				entry.bits.writable = writable;
+				entry.bits.user = 1;
+		}
+
+		/** @brief see FaultAroundPages */
+		size_t fault_around_pages = 32;
+		/** @brief the window of the first sequential fault in an area */
+		const size_t kFaultAroundMinPages = 4;
+
+		/** @brief decide the number of pages to map from page on a fault in vma.
+		*
+		*		The window doubles up to fault_around_pages while faults hit the page just after
+		*		the previous window, and it falls back to the faulting page only on other faults.
+		*/
+		size_t FaultAroundWindow(VMA& vma, uint64_t page) {
+				size_t window = 1;
+				if (page == vma.next_fault) {
+						window = std::max(vma.fault_window * 2, kFaultAroundMinPages);
+						window = std::min(window, fault_around_pages);
 				}
+				window = std::min<size_t>(window, (vma.size - (page - vma.begin)) / kPageSize4K);
+				vma.fault_window = window;
+				vma.next_fault = page + window * kPageSize4K;
+				return window;
+		}
 
-				const auto i = addr.Part(part);
-				return SetPageContent(table[i].Pointer(), part - 1, addr, content);
+		template <class F>
+		Error FaultAround(Task& task, VMA& vma, uint64_t page, F fill) {
+				const size_t window = FaultAroundWindow(vma, page);
+				const size_t num_filled = FillAbsentPages(LinearAddress4Level{page}, window, fill);
+				if (num_filled == 0) {
+						return MAKE_ERROR(Error::kNoEnoughMemory);
+				}
+				auto& stat = task.FaultStat();
+				stat.pages_mapped += num_filled;
+				stat.pages_around += num_filled - 1;
+				return MAKE_ERROR(Error::kSuccess);
 		}
-		Error CopyOnePage(uint64_t causal_addr) {
-				auto [ p, err ] = NewPageMap();
+
+
+		/** @brief return the level 1 entry for addr in the kernel page map.
+		*
+		*		Missing page maps are created if create is true. Otherwise nullptr is returned for them.
+		*/
+		WithError<PageMapEntry*> KernelPageEntry(LinearAddress4Level addr, bool create) {
+				auto page_map = reinterpret_cast<PageMapEntry*>(&pml4_table[0]);
+				for (int level = 4; level > 1; --level) {
+						auto& entry = page_map[addr.Part(level)];
+						if (!entry.bits.present && !create) {
+								return { nullptr, MAKE_ERROR(Error::kSuccess) };
+						}
+						auto [ child_map, err ] = SetNewPageMapIfNotPresent(entry);
+						if (err) {
+								return { nullptr, err };
+						}
+						entry.bits.writable = 1;
+						page_map = child_map;
+				}
+				return { &page_map[addr.Part(1)], MAKE_ERROR(Error::kSuccess) };
+		}
+
+		Error SwapIn(Task& task, PageMapEntry& entry, bool writable) {
+				auto [ frame, err ] = memory_manager->Allocate(1);
 				if (err) {
 						return err;
 				}
-				const auto aligned_addr = causal_addr & 0xffff'ffff'ffff'f000;
-				memcpy(p, reinterpret_cast<const void*>(aligned_addr), 4096);
-				return SetPageContent(reinterpret_cast<PageMapEntry*>(GetCR3()), 4,
-															LinearAddress4Level{causal_addr}, p);
+				if (auto err = swap_store->Load(entry.data >> 12, frame.Frame())) {
+						memory_manager->Free(frame, 1);
+						return err;
+				}
+				// a not-present entry is never cached, so no TLB entry needs to be invalidated
+				SetPageEntry(entry, reinterpret_cast<uintptr_t>(frame.Frame()), writable);
+				++task.FaultStat().swap_ins;
+				return MAKE_ERROR(Error::kSuccess);
+		}
+
+		/** @brief true if pages of the area are anonymous and may be swapped out */
+		bool IsSwappable(const VMA& vma) {
+				return (vma.type == VMA::kDemandPaging || vma.type == VMA::kStack) && vma.writable;
+		}
+
+		/** @brief drop a cached translation of a page of the task, which may not be the current one */
+		void InvalidateTaskTLB(Task& task, bool current, uint64_t vaddr) {
+				if (current) {
+						InvalidateTLB(vaddr);
+				} else {
+						task.Context().cr3 |= kCR3FlushOnRestore;
+				}
+		}
+
+		/** @brief swap out cold pages in [begin, end) of an area of the task. return true when num_frames are reached */
+		bool SwapOutRange(Task& task, bool current, uint64_t begin, uint64_t end,
+											size_t num_frames, size_t& num_swapped) {
+				const auto pml4 = current ? CurrentPML4() : PML4OfCR3(task.Context().cr3);
+				uint64_t page = begin;
+				while (page < end) {
+						int level;
+						auto entry = FindLeafEntry(pml4, LinearAddress4Level{page}, level);
+						if (entry == nullptr || level > 1) {
+								// skip the whole range of the missing page map or the 2 MiB page
+								const uint64_t skip = kPageSize4K << (9 * (level - 1));
+								page = (page & ~(skip - 1)) + skip;
+								continue;
+						}
+
+						const uint64_t vaddr = page;
+						page += kPageSize4K;
+						const auto frame_addr = reinterpret_cast<uintptr_t>(entry->Pointer());
+						const FrameID frame{frame_addr / kBytesPerFrame};
+						// shared frames (the zero page, copy-on-write, file pages) are not anonymous to this task
+						if (!entry->bits.present || IsFrameShared(frame)) {
+								continue;
+						}
+						if (entry->bits.accessed) {
+								entry->bits.accessed = 0;
+								InvalidateTaskTLB(task, current, vaddr);
+								continue;
+						}
+
+						// read the page through the identity mapping, since it may be of another task
+						bool donated;
+						auto [ slot, err ] = swap_store->Store(frame.Frame(), frame, donated);
+						if (err.Cause() == Error::kBufferTooSmall) {
+								continue; // hardly compresses
+						} else if (err) {
+								return true; // the store is full
+						}
+						entry->data = slot << 12 | kSwapEntryFlag;
+						InvalidateTaskTLB(task, current, vaddr);
+						if (!donated) {
+								memory_manager->Free(frame, 1);
+								++num_swapped;
+						}
+						swap_cursor_vaddr = page;
+						if (num_swapped >= num_frames) {
+								return true;
+						}
+				}
+				return false;
+		}
+
+		/** @brief swap out cold pages in [from, to) of the task. return true when num_frames are reached */
+		bool SwapOutTask(Task& task, bool current, uint64_t from, uint64_t to,
+										 size_t num_frames, size_t& num_swapped) {
+				for (const auto& [ begin, vma ] : task.AddrSpace().Areas()) {
+						if (!IsSwappable(vma)) {
+								continue;
+						}
+						const uint64_t area_end = vma.begin + vma.size;
+						if (area_end <= from || to <= vma.begin) {
+								continue;
+						}
+						if (SwapOutRange(task, current, std::max(from, vma.begin), std::min(to, area_end),
+														 num_frames, num_swapped)) {
+								return true;
+						}
+				}
+				return false;
+		}
+
+		Error CopyOnePage(uint64_t causal_addr) {
+				int level;
+				auto entry = FindLeafEntry(CurrentPML4(), LinearAddress4Level{causal_addr}, level);
+				if (entry == nullptr) {
+						return MAKE_ERROR(Error::kIndexOutOfRange);
+				}
+				const int order = level == 2 ? kPageOrder2M : 0;
+				const uint64_t page_bytes = kPageSize4K << order;
+				const auto aligned_addr = causal_addr & ~(page_bytes - 1);
+				const FrameID shared_frame{
+						reinterpret_cast<uintptr_t>(entry->Pointer()) / kBytesPerFrame};
+
+				if (!IsFrameShared(shared_frame)) {
+						// the last reference. take it over without copying.
+						entry->bits.writable = 1;
+						InvalidateTLB(aligned_addr);
+						return MAKE_ERROR(Error::kSuccess);
+				}
+
+				FrameID frame{kNullFrame};
+				if (reinterpret_cast<uintptr_t>(entry->Pointer()) == ZeroPageAddress()) {
+						auto [ zeroed, err ] = AllocateZeroedFrame();
+						if (err) {
+								return err;
+						}
+						frame = zeroed;
+				} else {
+						// the whole frame is overwritten, so it needs not to be zero-filled
+						auto [ copy, err ] = memory_manager->AllocateOrder(order);
+						if (err) {
+								return err;
+						}
+						memcpy(copy.Frame(), reinterpret_cast<const void*>(aligned_addr), page_bytes);
+						frame = copy;
+				}
+
+				entry->SetPointer(reinterpret_cast<PageMapEntry*>(frame.Frame()));
+				entry->bits.writable = 1;
+				InvalidateTLB(aligned_addr);
+				return ReleaseFrame(shared_frame, order);
 		}
 
 } // namespace
 
 WithError<PageMapEntry*> NewPageMap() {
-    auto frame = memory_manager->Allocate(1);
+    auto frame = AllocateZeroedFrame();
     if (frame.error) {
         return { nullptr, frame.error };
     }
 
     auto e = reinterpret_cast<PageMapEntry*>(frame.value.Frame());
-    memset(e, 0, sizeof(uint64_t) * 512);
     return { e, MAKE_ERROR(Error::kSuccess) };
 }
 
@@ -189,13 +717,31 @@ Error FreePageMap(PageMapEntry* table) {
 }
 
 Error SetupPageMaps(LinearAddress4Level addr, size_t num_4kpages, bool writable) {
-    auto pml4_table = reinterpret_cast<PageMapEntry*>(GetCR3());
+    auto pml4_table = CurrentPML4();
     return SetupPageMap(pml4_table, 4, addr, num_4kpages, writable).error;
 }
 
-Error CleanPageMaps(LinearAddress4Level addr) {
-    auto pml4_table = reinterpret_cast<PageMapEntry*>(GetCR3());
-		return CleanPageMap(pml4_table, 4, addr);
+Error CleanPageMaps(LinearAddress4Level addr, size_t num_4kpages) {
+		if (num_4kpages == 0) {
+				return MAKE_ERROR(Error::kSuccess);
+		}
+		const uint64_t last = addr.value + (num_4kpages * kPageSize4K - 1);
+
+		// for a large range, flushing the whole TLB once is cheaper than invalidating page by page
+		const bool flush_all = num_4kpages > kMaxInvalidatePages;
+		auto err = CleanPageMap(CurrentPML4(), 4, addr.value, last, !flush_all);
+		if (flush_all) {
+				// reloading CR3 drops non-global entries of the current PCID
+				SetCR3(GetCR3());
+		}
+		return err;
+}
+
+Error FreePageMaps(PageMapEntry* pml4) {
+		if (auto err = CleanPageMap(pml4, 4, 0xffff'8000'0000'0000, 0xffff'ffff'ffff'ffff, false)) {
+				return err;
+		}
+		return FreePageMap(pml4);
 }
 
 Error CopyPageMaps(PageMapEntry* dest, PageMapEntry* src, int part, int start) {
@@ -206,6 +752,7 @@ Error CopyPageMaps(PageMapEntry* dest, PageMapEntry* src, int part, int start) {
 						}
 						dest[i] = src[i];
 						dest[i].bits.writable = 0;
+						ShareFrame(FrameID{reinterpret_cast<uintptr_t>(src[i].Pointer()) / kBytesPerFrame});
 				}
 				return MAKE_ERROR(Error::kSuccess);
 		}
@@ -214,6 +761,12 @@ Error CopyPageMaps(PageMapEntry* dest, PageMapEntry* src, int part, int start) {
 				if (!src[i].bits.present) {
 						continue;
 				}
+				if (part == 2 && src[i].bits.huge_page) {
+						dest[i] = src[i];
+						dest[i].bits.writable = 0;
+						ShareFrame(FrameID{reinterpret_cast<uintptr_t>(src[i].Pointer()) / kBytesPerFrame});
+						continue;
+				}
 				auto [ table, err ] = NewPageMap();
 				if (err) {
 						return err;
@@ -227,21 +780,286 @@ Error CopyPageMaps(PageMapEntry* dest, PageMapEntry* src, int part, int start) {
 		return MAKE_ERROR(Error::kSuccess);
 }
 
+Error MapKernelPages(LinearAddress4Level addr, size_t num_4kpages) {
+		for (size_t i = 0; i < num_4kpages; ++i, addr.value += kPageSize4K) {
+				auto [ entry, err ] = KernelPageEntry(addr, true);
+				if (err) {
+						return err;
+				}
+				auto [ frame, err_alloc ] = NewPageMap();
+				if (err_alloc) {
+						return err_alloc;
+				}
+				entry->data = 0;
+				entry->SetPointer(frame);
+				entry->bits.present = 1;
+				entry->bits.writable = 1;
+				entry->bits.global = 1;
+		}
+		return MAKE_ERROR(Error::kSuccess);
+}
+
+Error UnmapKernelPages(LinearAddress4Level addr, size_t num_4kpages) {
+		for (size_t i = 0; i < num_4kpages; ++i, addr.value += kPageSize4K) {
+				auto [ entry, err ] = KernelPageEntry(addr, false);
+				if (err) {
+						return err;
+				}
+				if (entry == nullptr || !entry->bits.present) {
+						continue;
+				}
+				const auto frame = entry->Pointer();
+				entry->data = 0;
+				InvalidateTLB(addr.value);
+				if (auto err = FreePageMap(frame)) {
+						return err;
+				}
+		}
+		return MAKE_ERROR(Error::kSuccess);
+}
+
+Error FillDemandPage(Task& task, VMA& vma, uint64_t causal_addr, bool write) {
+		const uint64_t page = causal_addr & ~(kPageSize4K - 1);
+		if (!write) {
+				// pages only read stay zero. they share one frame until written.
+				const auto zero_addr = ZeroPageAddress();
+				auto& stat = task.FaultStat();
+				return FaultAround(task, vma, page, [&](uint64_t, PageMapEntry& entry) {
+						SetPageEntry(entry, zero_addr, false);
+						++stat.zero_pages;
+						return true;
+				});
+		}
+
+		if (SetupHugePageIfFit(causal_addr, vma)) {
+				++task.FaultStat().huge_pages;
+				return MAKE_ERROR(Error::kSuccess);
+		}
+		return FaultAround(task, vma, page, [](uint64_t, PageMapEntry& entry) {
+				auto [ frame, err ] = AllocateZeroedFrame();
+				if (err) {
+						return false;
+				}
+				SetPageEntry(entry, reinterpret_cast<uintptr_t>(frame.Frame()), true);
+				return true;
+		});
+}
+
+Error FillFilePage(Task& task, VMA& vma, uint64_t causal_addr, bool write) {
+		if (!vma.file) {
+				return MAKE_ERROR(Error::kInvalidDescriptor);
+		}
+		auto& file = *vma.file;
+
+		const uint64_t page = causal_addr & ~(kPageSize4K - 1);
+		const uint64_t region = causal_addr & ~(kPageSize2M - 1);
+		// pages of read-only areas (e.g. text) are small in number. map 2 MiB pages only to writable ones.
+		if (vma.writable && file.ResidentPage(vma.file_offset + (page - vma.begin)) == nullptr &&
+				SetupHugePageIfFit(causal_addr, vma)) {
+				const uint64_t in_area = region - vma.begin;
+				if (in_area < vma.file_bytes) {
+						file.Load(reinterpret_cast<void*>(region),
+											std::min(kPageSize2M, vma.file_bytes - in_area),
+											vma.file_offset + in_area);
+				}
+				++task.FaultStat().huge_pages;
+				return MAKE_ERROR(Error::kSuccess);
+		}
+
+		auto& stat = task.FaultStat();
+		return FaultAround(task, vma, page, [&](uint64_t vaddr, PageMapEntry& entry) {
+				const uint64_t in_area = vaddr - vma.begin;
+				const size_t offset = vma.file_offset + in_area;
+				if (in_area + kPageSize4K <= vma.file_bytes) {
+						if (auto resident = file.ResidentPage(offset)) {
+								// share the page with the file instead of copying it. the frame is pinned so that
+								// unmapping never frees it, and writing to the page copies it.
+								const auto resident_addr = reinterpret_cast<uintptr_t>(resident);
+								PinFrame(FrameID{resident_addr / kBytesPerFrame});
+								SetPageEntry(entry, resident_addr, false);
+								++stat.resident_pages;
+								return true;
+						}
+				}
+
+				// bytes beyond file_bytes (e.g. .bss) are left zero
+				auto [ frame, err ] = AllocateZeroedFrame();
+				if (err) {
+						return false;
+				}
+				if (in_area < vma.file_bytes) {
+						file.Load(frame.Frame(), std::min(kPageSize4K, vma.file_bytes - in_area), offset);
+				}
+				SetPageEntry(entry, reinterpret_cast<uintptr_t>(frame.Frame()), vma.writable);
+				return true;
+		});
+}
+
+Error FillSharedFilePage(Task& task, VMA& vma, uint64_t causal_addr, bool write) {
+		if (!vma.file) {
+				return MAKE_ERROR(Error::kInvalidDescriptor);
+		}
+		auto& file = *vma.file;
+
+		const uint64_t page = causal_addr & ~(kPageSize4K - 1);
+		return FaultAround(task, vma, page, [&](uint64_t vaddr, PageMapEntry& entry) {
+				const uint64_t in_area = vaddr - vma.begin;
+				if (in_area >= vma.file_bytes) {
+						// pages beyond the end of the file are private and never written back
+						auto [ frame, err ] = AllocateZeroedFrame();
+						if (err) {
+								return false;
+						}
+						SetPageEntry(entry, reinterpret_cast<uintptr_t>(frame.Frame()), vma.writable);
+						return true;
+				}
+
+				auto [ page_addr, err ] = page_cache->GetPage(file, vma.file_offset + in_area);
+				if (err) {
+						return false;
+				}
+				SetPageEntry(entry, page_addr, vma.writable);
+				return true;
+		});
+}
+
+Error WriteBackFilePages(const VMA& vma, uint64_t begin, uint64_t last) {
+		if (!vma.file) {
+				return MAKE_ERROR(Error::kInvalidDescriptor);
+		}
+		auto& stat = task_manager->CurrentTask().FaultStat();
+		const uint64_t first_page = begin / kPageSize4K;
+		const uint64_t last_page = last / kPageSize4K;
+		for (uint64_t i = first_page; i <= last_page; ++i) {
+				const uint64_t page = i * kPageSize4K;
+				int level;
+				auto entry = FindLeafEntry(CurrentPML4(), LinearAddress4Level{page}, level);
+				if (entry == nullptr || !entry->bits.present || !entry->bits.dirty) {
+						continue;
+				}
+
+				const uint64_t in_area = page - vma.begin;
+				if (in_area < vma.file_bytes) {
+						vma.file->Store(reinterpret_cast<const void*>(page),
+														std::min(kPageSize4K, vma.file_bytes - in_area),
+														vma.file_offset + in_area);
+						++stat.pages_written_back;
+				}
+				// the CPU sets the dirty bit again only after the cached entry is dropped
+				entry->bits.dirty = 0;
+				InvalidateTLB(page);
+		}
+		return MAKE_ERROR(Error::kSuccess);
+}
+
+size_t SwapOutColdPages(size_t num_frames) {
+		if (task_manager == nullptr || swap_store == nullptr) {
+				return 0;
+		}
+		Task& current_task = task_manager->CurrentTask();
+		size_t num_swapped = 0;
+		// the first round clears the accessed bits which the second round finds still clear if cold.
+		// each round scans the tasks from the cursor to the end and then from the beginning.
+		const size_t cursor_slot = swap_cursor_slot;
+		const uint64_t cursor_task_id = swap_cursor_task_id;
+		const uint64_t cursor_vaddr = swap_cursor_vaddr;
+		for (int round = 0; round < 4; ++round) {
+				const bool after_cursor = round % 2 == 0;
+				bool done = false;
+				task_manager->ForEachTask([&](Task& task, size_t slot) {
+						if (done || (!after_cursor && slot > cursor_slot)) {
+								return;
+						}
+						// the kernel may be about to write to the pages for a syscall of the task
+						if (task.PendingUserWrites() > 0) {
+								return;
+						}
+						const bool at_cursor = slot == cursor_slot && task.ID() == cursor_task_id;
+						const uint64_t from = after_cursor && at_cursor ? cursor_vaddr : 0;
+						const uint64_t to = after_cursor || slot < cursor_slot ? ~static_cast<uint64_t>(0)
+								: at_cursor ? cursor_vaddr : 0;
+						if (slot != swap_cursor_slot || task.ID() != swap_cursor_task_id) {
+								swap_cursor_slot = slot;
+								swap_cursor_task_id = task.ID();
+								swap_cursor_vaddr = from;
+						}
+						if (&task == &current_task) {
+								done = SwapOutTask(task, true, from, to, num_frames, num_swapped);
+						} else {
+								// the task must not change its page maps or finish during the scan
+								InterruptGuard guard;
+								done = SwapOutTask(task, false, from, to, num_frames, num_swapped);
+						}
+				}, after_cursor ? cursor_slot : 0);
+				if (done) {
+						return num_swapped;
+				}
+		}
+		return num_swapped;
+}
+
+size_t FaultAroundPages() {
+		return fault_around_pages;
+}
+
+void SetFaultAroundPages(size_t num_4kpages) {
+		fault_around_pages = std::min<size_t>(std::max<size_t>(num_4kpages, 1), 512);
+}
+
 Error HandlePageFault(uint64_t error_code, uint64_t causal_addr) {
 		auto& task = task_manager->CurrentTask();
 		const bool present = (error_code >> 0) & 1;
 		const bool rw			 = (error_code >> 1) & 1;
 		const bool user		 = (error_code >> 2) & 1;
-		if (present && rw && user) {
+		++task.FaultStat().faults;
+		VMA* vma = task.AddrSpace().Find(causal_addr);
+		if (vma == nullptr) {
+				return MAKE_ERROR(Error::kIndexOutOfRange);
+		}
+
+		if (present && rw && user && vma->writable) {
+				++task.FaultStat().copy_on_write;
 				return CopyOnePage(causal_addr);
 		} else if (present) {
 				return MAKE_ERROR(Error::kAlreadyAllocated);
 		}
-		if (task.DPagingBegin() <= causal_addr && causal_addr < task.DPagingEnd()) {
-				return SetupPageMaps(LinearAddress4Level{causal_addr}, 1);
+		int level;
+		if (auto entry = FindLeafEntry(CurrentPML4(), LinearAddress4Level{causal_addr}, level);
+				entry && IsSwapEntry(*entry)) {
+				return SwapIn(task, *entry, vma->writable);
 		}
-		if (auto m = FindFileMapping(task.FileMaps(), causal_addr)) {
-				return PreparePageCache(*task.Files()[m->fd], *m, causal_addr);
+		if (vma->on_fault == nullptr) {
+				return MAKE_ERROR(Error::kIndexOutOfRange);
 		}
-		return MAKE_ERROR(Error::kIndexOutOfRange);
-}
\ No newline at end of file
+		return vma->on_fault(task, *vma, causal_addr, rw);
+}
+
+Error PrepareUserWrite(uint64_t addr, size_t bytes) {
+		if (bytes == 0) {
+				return MAKE_ERROR(Error::kSuccess);
+		}
+		if (addr + (bytes - 1) < addr) {
+				return MAKE_ERROR(Error::kIndexOutOfRange);
+		}
+
+		auto& task = task_manager->CurrentTask();
+		const uint64_t first_page = addr / kPageSize4K;
+		const uint64_t last_page = (addr + (bytes - 1)) / kPageSize4K;
+		for (uint64_t i = first_page; i <= last_page; ++i) {
+				const uint64_t page = i * kPageSize4K;
+				VMA* vma = task.AddrSpace().Find(page);
+				if (vma == nullptr || !vma->writable) {
+						continue;
+				}
+				int level;
+				auto entry = FindLeafEntry(CurrentPML4(), LinearAddress4Level{page}, level);
+				if (entry == nullptr || !entry->bits.present || entry->bits.writable) {
+						continue;
+				}
+				++task.FaultStat().copy_on_write;
+				if (auto err = CopyOnePage(page)) {
+						return err;
+				}
+		}
+		return MAKE_ERROR(Error::kSuccess);
+}
@@ -9,20 +9,45 @@
 
 #include "error.hpp"
 
+class Task;
+struct VMA;
+struct MemoryMap;
+
 /** @brief the number of page directories to allocate statically.
 *
-*   This constant is used in SetupIdentityPageMap.
+*   This constant is used in SetupIdentityPageTable.
 *   512 2MiB pages can be set in one page directory.
-*   So, kPageDirectoryCount * 1GiB virtual addresses are mapped.
+*   So, kBootPageDirectoryCount * 1GiB virtual addresses are mapped at boot,
+*   which covers memory mapped I/O below 4 GiB. They are not used if 1 GiB pages are supported.
 */
-const size_t kPageDirectoryCount = 64;
+const size_t kBootPageDirectoryCount = 4;
+
+/** @brief the identity mapping covers at least this range (64 GiB) for MMIO out of the memory map */
+const uint64_t kMinIdentityMapBytes = 64ull * 1024 * 1024 * 1024;
 
 /** @brief set page table as virtual address = physical address.
 *   In the end, CR3 register points the page table which is correctly set.
+*
+*   The first kBootPageDirectoryCount GiB are mapped by 1 GiB pages if the CPU supports them,
+*   by 2 MiB pages otherwise.
 */
 void SetupIdentityPageTable();
 
+/** @brief extend the identity mapping to the end of the physical addresses in the memory map
+*   or kMinIdentityMapBytes, whichever is larger (up to 512 GiB),
+*   then let memory_manager allocate all the mapped frames.
+*
+*   64 bit PCI BARs and the frame buffer may lie above the RAM without appearing in the memory map,
+*   so at least kMinIdentityMapBytes are mapped as before.
+*
+*   Without 1 GiB pages, page directories are allocated from memory_manager.
+*   This must be called after InitializeMemoryManager.
+*/
+void ExtendIdentityMapping(const MemoryMap& memory_map);
+
+/** @brief set up the identity page map and enable global pages and PCID (if supported) */
 void InitializePaging();
+/** @brief switch to the kernel page map */
 void ResetCR3();
 
 union LinearAddress4Level {
@@ -87,10 +112,112 @@ union PageMapEntry {
     }
 };
 
+/** @brief return the PML4 table which CR3 points to */
+PageMapEntry* CurrentPML4();
+
+/** @brief OR-ed to TaskContext::cr3 of a task whose page map is modified while it is not running.
+*
+*   RestoreContext flushes the TLB entries of the PCID instead of keeping them when it switches to the task.
+*/
+const uint64_t kCR3FlushOnRestore = 1ull << 62;
+/** @brief return the PML4 table of a CR3 value saved in a task context */
+PageMapEntry* PML4OfCR3(uint64_t cr3);
+
+/** @brief return the entry which maps addr to a page in the page map.
+*
+*   level is set to 1 for a 4 KiB page and 2 for a 2 MiB page.
+*   nullptr is returned if a page map on the way is not present. level is the level of the missing entry then.
+*/
+PageMapEntry* FindLeafEntry(PageMapEntry* pml4, LinearAddress4Level addr, int& level);
+
+/** @brief the frame mapped read-only to pages which are known to be zero-filled. It is never freed */
+uintptr_t ZeroPageAddress();
+/** @brief return a CR3 value to switch to the given PML4 table with a newly assigned PCID.
+*
+*   Loading the value without bit 63 flushes TLB entries left by former users of the PCID.
+*   Without PCID support, the value is just the address of the table.
+*/
+WithError<uint64_t> NewCR3(PageMapEntry* pml4);
+/** @brief release the PCID of a CR3 value returned by NewCR3 */
+void FreeCR3(uint64_t cr3);
+
 WithError<PageMapEntry*> NewPageMap();
 Error FreePageMap(PageMapEntry* table);
 Error SetupPageMaps(LinearAddress4Level addr, size_t num_4kpages,
 										bool writable = true);
-Error CleanPageMaps(LinearAddress4Level addr);
+/** @brief unmap pages in [addr, addr + num_4kpages * 4KiB) of the current page map and release their frames.
+*
+*   Page maps which become empty are freed.
+*/
+Error CleanPageMaps(LinearAddress4Level addr, size_t num_4kpages);
 Error CopyPageMaps(PageMapEntry* dest, PageMapEntry* src, int part, int start);
-Error HandlePageFault(uint64_t error_code, uint64_t causal_addr);
\ No newline at end of file
+/** @brief release pages of the upper half (apps) of a PML4 table which is not in use, and free the table */
+Error FreePageMaps(PageMapEntry* pml4);
+Error HandlePageFault(uint64_t error_code, uint64_t causal_addr);
+
+/** @brief page fault counters of a task */
+struct PageFaultStat {
+		/** @brief page faults handled */
+		size_t faults;
+		/** @brief faults resolved by copying a shared page */
+		size_t copy_on_write;
+		/** @brief 4 KiB pages mapped by fault handlers, including the faulting pages */
+		size_t pages_mapped;
+		/** @brief pages among pages_mapped which were mapped ahead of access (fault-around) */
+		size_t pages_around;
+		/** @brief 2 MiB pages mapped by fault handlers */
+		size_t huge_pages;
+		/** @brief pages mapped to file contents in memory without copying */
+		size_t resident_pages;
+		/** @brief pages mapped to the shared zero page on read faults */
+		size_t zero_pages;
+		/** @brief dirty pages of shared file maps written back to the files */
+		size_t pages_written_back;
+		/** @brief faults resolved by decompressing a swapped out page */
+		size_t swap_ins;
+};
+
+/** @brief VMAFaultHandler of demand paging areas: map zero-filled pages.
+*
+*   A read fault maps the shared zero page read-only. A frame is allocated when the page is
+*   written first (copy-on-write).
+*/
+Error FillDemandPage(Task& task, VMA& vma, uint64_t causal_addr, bool write);
+/** @brief VMAFaultHandler of file-backed areas (file maps and executables): map pages with the file contents */
+Error FillFilePage(Task& task, VMA& vma, uint64_t causal_addr, bool write);
+/** @brief VMAFaultHandler of shared file maps: map pages of the page cache writable.
+*
+*   Writes are not copied; they are tracked by the dirty bits and written back by WriteBackFilePages.
+*/
+Error FillSharedFilePage(Task& task, VMA& vma, uint64_t causal_addr, bool write);
+/** @brief write dirty pages of a shared file map in [begin, last] of the current page map
+*   back to the file and clear the dirty bits.
+*/
+Error WriteBackFilePages(const VMA& vma, uint64_t begin, uint64_t last);
+
+/** @brief copy shared pages in [addr, addr + bytes) of the current task before the kernel writes there.
+*
+*   CR0.WP is cleared, so a kernel write to a read-only page does not fault and would modify
+*   a frame shared with others (e.g. the zero page). Not-present pages are left to page faults.
+*/
+Error PrepareUserWrite(uint64_t addr, size_t bytes);
+
+/** @brief MemoryReclaimer: compress cold anonymous pages of the current task into swap_store and unmap them.
+*
+*   Pages accessed since the last scan are skipped and their accessed bits are cleared (second chance).
+*   A page is decompressed into a new frame on the next fault to it.
+*/
+size_t SwapOutColdPages(size_t num_frames);
+
+/** @brief the maximum number of pages a fault maps when an area is accessed sequentially */
+size_t FaultAroundPages();
+void SetFaultAroundPages(size_t num_4kpages);
+
+/** @brief map newly allocated frames to [addr, addr + num_4kpages * 4KiB) in the kernel page map.
+*
+*   Pages are writable and accessible only from the kernel.
+*   Page maps under a PML4 entry are shared by all the tasks once the entry is present.
+*/
+Error MapKernelPages(LinearAddress4Level addr, size_t num_4kpages);
+/** @brief unmap pages mapped by MapKernelPages and free their frames */
+Error UnmapKernelPages(LinearAddress4Level addr, size_t num_4kpages);
\ No newline at end of file
@@ -16,13 +16,14 @@ namespace {
 				tss[index + 1]	= value >> 32;
 		}
 
-		uint64_t AllocateStackArea(int num_4kframes) {
-				auto [ stk, err ] = memory_manager->Allocate(num_4kframes);
+		/** @brief allocate 2^order frames as a stack and return its end */
+		uint64_t AllocateStackArea(int order) {
+				auto [ stk, err ] = memory_manager->AllocateOrder(order);
 				if (err) {
 						Log(kError, "failed to allocate stack area: %s\n", err.Name());
 						exit(1);
 				}
-				return reinterpret_cast<uint64_t>(stk.Frame()) + num_4kframes * 4096;
+				return reinterpret_cast<uint64_t>(stk.Frame()) + (4096 << order);
 		}
 }
 
@@ -87,8 +88,8 @@ void InitializeSegmentation() {
 }
 
 void InitializeTSS() {
-		SetTSS(1, AllocateStackArea(8));
-		SetTSS(7 + 2 * kISTForTimer, AllocateStackArea(8));
+		SetTSS(1, AllocateStackArea(3)); // 8 frames
+		SetTSS(7 + 2 * kISTForTimer, AllocateStackArea(3));
 
 		uint64_t tss_addr = reinterpret_cast<uint64_t>(&tss[0]);
 		SetSystemSegment(gdt[kTSS >> 3], DescriptorType::kTSSAvailable, 0,
@@ -0,0 +1,230 @@
+#include "slab.hpp"
+
+#include <cstdlib>
+#include <new>
+
+#include "interrupt.hpp"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+
+struct SlabCache::Slab {
+		Slab* next;
+		Slab* prev;
+		void* free_list;
+		size_t num_used;
+};
+
+namespace {
+		/** @brief objects in a slab start from this offset so that they are aligned to 64 bytes at least */
+		const size_t kSlabHeaderBytes = 64;
+
+		/** @brief a slab holds this many objects at least */
+		const size_t kMinObjectsPerSlab = 8;
+
+		size_t SlabBytes(int order) {
+				return kBytesPerFrame << order;
+		}
+}
+
+SlabCache::SlabCache(const char* name, size_t object_size)
+		: name_{name}, object_size_{object_size}, slab_order_{0} {
+		static_assert(sizeof(Slab) <= kSlabHeaderBytes);
+		while (SlabBytes(slab_order_) < kSlabHeaderBytes + kMinObjectsPerSlab * object_size_) {
+				++slab_order_;
+		}
+		objects_per_slab_ = (SlabBytes(slab_order_) - kSlabHeaderBytes) / object_size_;
+}
+
+void* SlabCache::Allocate() {
+		InterruptGuard guard;
+
+		if (magazine_count_ == 0) {
+				while (magazine_count_ < kMagazineSize / 2) {
+						auto obj = AllocateFromSlab();
+						if (obj == nullptr) {
+								break;
+						}
+						magazine_[magazine_count_++] = obj;
+				}
+				if (magazine_count_ == 0) {
+						return nullptr;
+				}
+		} else {
+				++num_magazine_hits_;
+		}
+
+		++num_allocations_;
+		++num_in_use_;
+		return magazine_[--magazine_count_];
+}
+
+void SlabCache::Free(void* obj) {
+		InterruptGuard guard;
+
+		if (magazine_count_ == kMagazineSize) {
+				// return the older half, keeping recently freed (cache hot) objects in the magazine
+				const size_t n = kMagazineSize / 2;
+				for (size_t i = 0; i < n; ++i) {
+						FreeToSlab(magazine_[i]);
+				}
+				for (size_t i = n; i < kMagazineSize; ++i) {
+						magazine_[i - n] = magazine_[i];
+				}
+				magazine_count_ -= n;
+		}
+
+		--num_in_use_;
+		magazine_[magazine_count_++] = obj;
+}
+
+SlabStat SlabCache::Stat() const {
+		return {
+				name_,
+				object_size_,
+				num_in_use_,
+				magazine_count_,
+				num_slabs_ * objects_per_slab_,
+				num_slabs_,
+				num_allocations_,
+				num_magazine_hits_,
+		};
+}
+
+SlabCache::Slab* SlabCache::SlabOf(void* obj) const {
+		const auto addr = reinterpret_cast<uintptr_t>(obj);
+		return reinterpret_cast<Slab*>(addr & ~(SlabBytes(slab_order_) - 1));
+}
+
+void* SlabCache::AllocateFromSlab() {
+		if (partial_ == nullptr) {
+				Slab* slab = empty_;
+				empty_ = nullptr;
+				if (slab == nullptr) {
+						// refills may run in interrupt handlers, which may have interrupted malloc.
+						// reclaimers free memory to newlib, so they must not run here.
+						auto [ frame, err ] = memory_manager->AllocateBlock(slab_order_);
+						if (err) {
+								return nullptr;
+						}
+						++num_slabs_;
+
+						slab = reinterpret_cast<Slab*>(frame.Frame());
+						slab->free_list = nullptr;
+						slab->num_used = 0;
+						auto objs = reinterpret_cast<uintptr_t>(slab) + kSlabHeaderBytes;
+						for (size_t i = objects_per_slab_; i > 0; --i) {
+								auto obj = reinterpret_cast<void**>(objs + (i - 1) * object_size_);
+								*obj = slab->free_list;
+								slab->free_list = obj;
+						}
+				}
+				PushPartial(slab);
+		}
+
+		Slab* slab = partial_;
+		auto obj = reinterpret_cast<void**>(slab->free_list);
+		slab->free_list = *obj;
+		++slab->num_used;
+		if (slab->free_list == nullptr) {
+				RemovePartial(slab);
+		}
+		return obj;
+}
+
+void SlabCache::FreeToSlab(void* obj) {
+		Slab* slab = SlabOf(obj);
+		if (slab->free_list == nullptr) {
+				PushPartial(slab);
+		}
+		*reinterpret_cast<void**>(obj) = slab->free_list;
+		slab->free_list = obj;
+
+		if (--slab->num_used > 0) {
+				return;
+		}
+		RemovePartial(slab);
+		if (empty_ == nullptr) {
+				empty_ = slab;
+				return;
+		}
+		const auto frame = FrameID{reinterpret_cast<uintptr_t>(slab) / kBytesPerFrame};
+		memory_manager->FreeOrder(frame, slab_order_);
+		--num_slabs_;
+}
+
+void SlabCache::PushPartial(Slab* slab) {
+		slab->prev = nullptr;
+		slab->next = partial_;
+		if (partial_) {
+				partial_->prev = slab;
+		}
+		partial_ = slab;
+}
+
+void SlabCache::RemovePartial(Slab* slab) {
+		if (slab->prev) {
+				slab->prev->next = slab->next;
+		} else {
+				partial_ = slab->next;
+		}
+		if (slab->next) {
+				slab->next->prev = slab->prev;
+		}
+}
+
+namespace {
+		const char* const kSizeClassNames[kNumSlabSizeClasses] = {
+				"slab-32", "slab-64", "slab-128", "slab-256",
+				"slab-512", "slab-1k", "slab-2k", "slab-4k",
+		};
+		static_assert((32 << (kNumSlabSizeClasses - 1)) == kSlabMaxObjectBytes);
+
+		alignas(SlabCache) char slab_caches_buf[sizeof(SlabCache) * kNumSlabSizeClasses];
+		SlabCache* slab_caches;
+
+		int SizeClass(size_t size) {
+				int size_class = 0;
+				while ((static_cast<size_t>(32) << size_class) < size) {
+						++size_class;
+				}
+				return size_class;
+		}
+}
+
+void* SlabAllocate(size_t size) {
+		if (size > kSlabMaxObjectBytes) {
+				return ::operator new(size);
+		}
+		return slab_caches[SizeClass(size)].Allocate();
+}
+
+void* SlabAllocateOrAbort(size_t size) {
+		void* p = SlabAllocate(size);
+		if (p == nullptr) {
+				Log(kError, "slab allocation of %lu bytes failed\n", size);
+				abort();
+		}
+		return p;
+}
+
+void SlabFree(void* p, size_t size) {
+		if (p == nullptr) {
+				return;
+		}
+		if (size > kSlabMaxObjectBytes) {
+				::operator delete(p);
+				return;
+		}
+		slab_caches[SizeClass(size)].Free(p);
+}
+
+SlabStat SlabSizeClassStat(int size_class) {
+		return slab_caches[size_class].Stat();
+}
+
+void InitializeSlab() {
+		slab_caches = reinterpret_cast<SlabCache*>(slab_caches_buf);
+		for (int i = 0; i < kNumSlabSizeClasses; ++i) {
+				new(&slab_caches[i]) SlabCache{kSizeClassNames[i], static_cast<size_t>(32) << i};
+		}
+}
@@ -0,0 +1,132 @@
+/*
+* file collecting slab allocator which caches small kernel objects by size class
+*/
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+struct SlabStat {
+		const char* name;
+		size_t object_size;
+		/** @brief objects handed out and not yet freed */
+		size_t objects_in_use;
+		/** @brief free objects held in the magazine */
+		size_t objects_cached;
+		/** @brief capacity of all slabs owned by the cache */
+		size_t objects_total;
+		size_t slabs;
+		size_t allocations;
+		/** @brief allocations served from the magazine without touching slabs */
+		size_t magazine_hits;
+};
+
+/** @brief object cache of a fixed object size.
+*
+*   Objects are carved out of slabs, i.e. 2^order frames from memory_manager aligned to their size.
+*   The header of a slab (struct Slab) sits at its beginning, so the slab of an object is found
+*   by masking the address. Free objects in a slab are chained by intrusive free list.
+*
+*   Recently freed objects are kept in a magazine (a small LIFO array) in front of slabs.
+*   Allocate / Free usually complete by one push / pop on it, and slabs are touched only
+*   when the magazine runs empty (refill half) or full (flush half).
+*/
+class SlabCache {
+		public:
+				static const size_t kMagazineSize = 16;
+
+				SlabCache(const char* name, size_t object_size);
+				void* Allocate();
+				void Free(void* obj);
+				SlabStat Stat() const;
+
+				size_t ObjectSize() const { return object_size_; }
+
+		private:
+				struct Slab;
+
+				const char* name_;
+				size_t object_size_;
+				/** @brief a slab has 2^slab_order_ frames */
+				int slab_order_;
+				size_t objects_per_slab_;
+
+				/** @brief slabs which have at least one free object and are not empty */
+				Slab* partial_{nullptr};
+				/** @brief an empty slab kept to avoid returning and re-allocating frames repeatedly */
+				Slab* empty_{nullptr};
+
+				std::array<void*, kMagazineSize> magazine_{};
+				size_t magazine_count_{0};
+
+				size_t num_slabs_{0};
+				size_t num_in_use_{0};
+				size_t num_allocations_{0};
+				size_t num_magazine_hits_{0};
+
+				Slab* SlabOf(void* obj) const;
+				/** @brief take a free object from slabs, growing the cache if needed */
+				void* AllocateFromSlab();
+				/** @brief return an object to its slab, releasing the slab if it becomes empty */
+				void FreeToSlab(void* obj);
+				void PushPartial(Slab* slab);
+				void RemovePartial(Slab* slab);
+};
+
+/** @brief objects larger than this are allocated from newlib heap */
+const size_t kSlabMaxObjectBytes = 4096;
+/** @brief the number of size classes (32, 64, ..., kSlabMaxObjectBytes bytes) */
+const int kNumSlabSizeClasses = 8;
+
+/** @brief allocate size bytes from the cache of the smallest size class which fits */
+void* SlabAllocate(size_t size);
+/** @brief SlabAllocate for new-expressions and containers. abort on exhaustion as ::operator new does */
+void* SlabAllocateOrAbort(size_t size);
+/** @brief free memory allocated by SlabAllocate. size must be the one passed to SlabAllocate */
+void SlabFree(void* p, size_t size);
+SlabStat SlabSizeClassStat(int size_class);
+
+/** @brief base class to allocate instances of the derived class from slab caches by new / delete.
+*
+*   operator new aborts when slabs are exhausted, so callers need not check nullptr.
+*/
+class SlabObject {
+		public:
+				static void* operator new(size_t size) { return SlabAllocateOrAbort(size); }
+				static void operator delete(void* p, size_t size) { SlabFree(p, size); }
+};
+
+/** @brief allocator for standard containers / allocate_shared backed by slab caches */
+template <class T>
+class SlabAllocator {
+		public:
+				using value_type = T;
+
+				SlabAllocator() = default;
+				template <class U>
+				SlabAllocator(const SlabAllocator<U>&) {}
+
+				T* allocate(size_t n) {
+						return reinterpret_cast<T*>(SlabAllocateOrAbort(n * sizeof(T)));
+				}
+				void deallocate(T* p, size_t n) {
+						SlabFree(p, n * sizeof(T));
+				}
+};
+
+template <class T, class U>
+bool operator==(const SlabAllocator<T>&, const SlabAllocator<U>&) { return true; }
+template <class T, class U>
+bool operator!=(const SlabAllocator<T>&, const SlabAllocator<U>&) { return false; }
+
+/** @brief std::make_shared whose object and control block come from slab caches */
+template <class T, class... Args>
+std::shared_ptr<T> MakeSlabShared(Args&&... args) {
+		return std::allocate_shared<T>(SlabAllocator<T>{}, std::forward<Args>(args)...);
+}
+
+void InitializeSlab();
@@ -0,0 +1,300 @@
+#include "swap.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+#include "asmfunc.h"
+#include "interrupt.hpp"
+#include "paging.hpp"
+
+namespace {
+		const size_t kPageBytes = 4096;
+		const size_t kMinMatch = 4;
+		/** @brief LZ4 end-of-block rules: the last 5 bytes are literals and the last match
+		 * starts at least 12 bytes before the end */
+		const size_t kLastLiterals = 5;
+		const size_t kMatchStartLimit = 12;
+		const int kHashBits = 12;
+		const uint16_t kNoPosition = 0xffff;
+		const int kObjectIndexBits = 5;
+
+		uint32_t Read32(const uint8_t* p) {
+				uint32_t v;
+				memcpy(&v, p, sizeof(v));
+				return v;
+		}
+
+		size_t Hash(uint32_t v) {
+				return (v * 2654435761u) >> (32 - kHashBits);
+		}
+
+		/** @brief the bytes to encode a length of a token field (4 bits) followed by 255-continued bytes */
+		size_t ExtraLengthBytes(size_t len) {
+				return len < 15 ? 0 : (len - 15) / 255 + 1;
+		}
+
+		uint8_t* PutExtraLength(uint8_t* out, size_t len) {
+				if (len < 15) {
+						return out;
+				}
+				for (len -= 15; len >= 255; len -= 255) {
+						*out++ = 255;
+				}
+				*out++ = len;
+				return out;
+		}
+
+		/** @brief read the rest of a length after a token field of 15. return false at the end of input */
+		bool GetExtraLength(const uint8_t*& in, const uint8_t* in_end, size_t& len) {
+				uint8_t b;
+				do {
+						if (in == in_end) {
+								return false;
+						}
+						b = *in++;
+						len += b;
+				} while (b == 255);
+				return true;
+		}
+
+		/** @brief the output of LZCompress before it is copied into a pool object */
+		alignas(16) uint8_t compress_buf[kPageBytes];
+
+		uint32_t FullMask(size_t size_class) {
+				const size_t num_objects = kPageBytes / (size_class * SwapStore::kUnitBytes);
+				return num_objects >= 32 ? 0xffffffffu : (1u << num_objects) - 1;
+		}
+}
+
+size_t LZCompress(const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_cap) {
+		std::array<uint16_t, 1 << kHashBits> table;
+		table.fill(kNoPosition);
+
+		uint8_t* out = dst;
+		const uint8_t* const out_end = dst + dst_cap;
+		size_t anchor = 0; // beginning of pending literals
+		size_t i = 0;
+		while (i + kMatchStartLimit <= src_len) {
+				const uint32_t v = Read32(&src[i]);
+				const size_t h = Hash(v);
+				const size_t candidate = table[h];
+				table[h] = i;
+				if (candidate == kNoPosition || Read32(&src[candidate]) != v) {
+						++i;
+						continue;
+				}
+
+				size_t match_len = kMinMatch;
+				while (i + match_len < src_len - kLastLiterals &&
+							 src[candidate + match_len] == src[i + match_len]) {
+						++match_len;
+				}
+				const size_t lit_len = i - anchor;
+				const size_t seq_bytes = 1 + ExtraLengthBytes(lit_len) + lit_len + 2 +
+						ExtraLengthBytes(match_len - kMinMatch);
+				if (out_end - out < seq_bytes) {
+						return 0;
+				}
+
+				*out++ = std::min<size_t>(lit_len, 15) << 4 | std::min<size_t>(match_len - kMinMatch, 15);
+				out = PutExtraLength(out, lit_len);
+				memcpy(out, &src[anchor], lit_len);
+				out += lit_len;
+				const size_t offset = i - candidate;
+				*out++ = offset & 0xff;
+				*out++ = offset >> 8;
+				out = PutExtraLength(out, match_len - kMinMatch);
+
+				i += match_len;
+				anchor = i;
+		}
+
+		// the last sequence has literals only
+		const size_t lit_len = src_len - anchor;
+		if (out_end - out < 1 + ExtraLengthBytes(lit_len) + lit_len) {
+				return 0;
+		}
+		*out++ = std::min<size_t>(lit_len, 15) << 4;
+		out = PutExtraLength(out, lit_len);
+		memcpy(out, &src[anchor], lit_len);
+		out += lit_len;
+		return out - dst;
+}
+
+bool LZDecompress(const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_len) {
+		const uint8_t* in = src;
+		const uint8_t* const in_end = src + src_len;
+		uint8_t* out = dst;
+		uint8_t* const out_end = dst + dst_len;
+		while (in < in_end) {
+				const uint8_t token = *in++;
+				size_t lit_len = token >> 4;
+				if (lit_len == 15 && !GetExtraLength(in, in_end, lit_len)) {
+						return false;
+				}
+				if (in_end - in < lit_len || out_end - out < lit_len) {
+						return false;
+				}
+				memcpy(out, in, lit_len);
+				in += lit_len;
+				out += lit_len;
+				if (in == in_end) {
+						break;
+				}
+
+				if (in_end - in < 2) {
+						return false;
+				}
+				const size_t offset = in[0] | static_cast<size_t>(in[1]) << 8;
+				in += 2;
+				size_t match_len = token & 0xf;
+				if (match_len == 15 && !GetExtraLength(in, in_end, match_len)) {
+						return false;
+				}
+				match_len += kMinMatch;
+				if (offset == 0 || out - dst < offset || out_end - out < match_len) {
+						return false;
+				}
+				// a match may overlap the bytes it produces, so copy byte by byte
+				for (const uint8_t* from = out - offset; match_len > 0; --match_len) {
+						*out++ = *from++;
+				}
+		}
+		return out == out_end;
+}
+
+SwapStore::SwapStore() {
+		partial_.fill(kNil);
+		for (size_t i = 0; i < kMaxPoolFrames; ++i) {
+				frames_[i].next = i + 1 < kMaxPoolFrames ? i + 1 : kNil;
+		}
+		free_frames_ = 0;
+}
+
+WithError<uint64_t> SwapStore::Store(const void* page, FrameID frame, bool& donated) {
+		InterruptGuard guard;
+		donated = false;
+		// an object begins with the compressed size (2 bytes)
+		const size_t len = LZCompress(reinterpret_cast<const uint8_t*>(page), kPageBytes,
+																	compress_buf + 2, kMaxObjectBytes - 2);
+		if (len == 0) {
+				++stat_.rejected;
+				return { 0, MAKE_ERROR(Error::kBufferTooSmall) };
+		}
+		compress_buf[0] = len & 0xff;
+		compress_buf[1] = len >> 8;
+
+		const size_t size_class = (len + 2 + kUnitBytes - 1) / kUnitBytes;
+		uint16_t index = partial_[size_class];
+		if (index == kNil) {
+				if (free_frames_ == kNil) {
+						return { 0, MAKE_ERROR(Error::kFull) };
+				}
+				uint8_t* data;
+				if (auto [ pool_frame, err ] = memory_manager->Allocate(1); !err) {
+						data = reinterpret_cast<uint8_t*>(pool_frame.Frame());
+				} else {
+						// the page is already compressed. its frame holds objects from now on.
+						data = reinterpret_cast<uint8_t*>(frame.Frame());
+						donated = true;
+				}
+				index = free_frames_;
+				free_frames_ = frames_[index].next;
+				frames_[index] = PoolFrame{data, 0, kNil, kNil, static_cast<uint8_t>(size_class)};
+				PushPartial(index);
+				++stat_.pool_frames;
+		}
+
+		auto& pool_frame = frames_[index];
+		const int object = __builtin_ctz(~pool_frame.used);
+		pool_frame.used |= 1u << object;
+		if (pool_frame.used == FullMask(size_class)) {
+				RemovePartial(index);
+		}
+
+		const uint64_t slot = static_cast<uint64_t>(index) << kObjectIndexBits | object;
+		memcpy(ObjectOf(slot), compress_buf, len + 2);
+		++stat_.pages;
+		stat_.compressed_bytes += len;
+		++stat_.swap_outs;
+		return { slot, MAKE_ERROR(Error::kSuccess) };
+}
+
+Error SwapStore::Load(uint64_t slot, void* page) {
+		InterruptGuard guard;
+		const uint64_t begin = ReadTSC();
+		const uint8_t* object = ObjectOf(slot);
+		const size_t len = object[0] | static_cast<size_t>(object[1]) << 8;
+		if (!LZDecompress(object + 2, len, reinterpret_cast<uint8_t*>(page), kPageBytes)) {
+				return MAKE_ERROR(Error::kInvalidFormat);
+		}
+		stat_.swap_in_cycles += ReadTSC() - begin;
+		++stat_.swap_ins;
+		Free(slot);
+		return MAKE_ERROR(Error::kSuccess);
+}
+
+void SwapStore::Free(uint64_t slot) {
+		InterruptGuard guard;
+		const uint16_t index = slot >> kObjectIndexBits;
+		const int object = slot & ((1u << kObjectIndexBits) - 1);
+		auto& pool_frame = frames_[index];
+		const uint8_t* data = ObjectOf(slot);
+		--stat_.pages;
+		stat_.compressed_bytes -= data[0] | static_cast<size_t>(data[1]) << 8;
+
+		const bool was_full = pool_frame.used == FullMask(pool_frame.size_class);
+		pool_frame.used &= ~(1u << object);
+		if (pool_frame.used == 0) {
+				if (!was_full) {
+						RemovePartial(index);
+				}
+				ReleaseFrame(FrameID{reinterpret_cast<uintptr_t>(pool_frame.data) / kBytesPerFrame}, 0);
+				pool_frame.next = free_frames_;
+				free_frames_ = index;
+				--stat_.pool_frames;
+		} else if (was_full) {
+				PushPartial(index);
+		}
+}
+
+uint8_t* SwapStore::ObjectOf(uint64_t slot) const {
+		const auto& pool_frame = frames_[slot >> kObjectIndexBits];
+		const size_t object = slot & ((1u << kObjectIndexBits) - 1);
+		return pool_frame.data + object * pool_frame.size_class * kUnitBytes;
+}
+
+void SwapStore::PushPartial(uint16_t index) {
+		auto& head = partial_[frames_[index].size_class];
+		frames_[index].prev = kNil;
+		frames_[index].next = head;
+		if (head != kNil) {
+				frames_[head].prev = index;
+		}
+		head = index;
+}
+
+void SwapStore::RemovePartial(uint16_t index) {
+		auto& pool_frame = frames_[index];
+		if (pool_frame.prev == kNil) {
+				partial_[pool_frame.size_class] = pool_frame.next;
+		} else {
+				frames_[pool_frame.prev].next = pool_frame.next;
+		}
+		if (pool_frame.next != kNil) {
+				frames_[pool_frame.next].prev = pool_frame.prev;
+		}
+		pool_frame.prev = pool_frame.next = kNil;
+}
+
+SwapStore* swap_store;
+
+namespace {
+		alignas(SwapStore) char swap_store_buf[sizeof(SwapStore)];
+}
+
+void InitializeSwap() {
+		swap_store = new(swap_store_buf) SwapStore;
+		memory_manager->AddReclaimer(SwapOutColdPages);
+}
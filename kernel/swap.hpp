@@ -0,0 +1,91 @@
+/*
+* file collecting programs to keep cold pages of applications compressed in memory
+*/
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include "error.hpp"
+#include "memory_manager.hpp"
+
+/** @brief compress src_len bytes of src into dst with an LZ77 codec (LZ4 block format).
+*
+*   return the compressed size, or 0 if it exceeds dst_cap.
+*/
+size_t LZCompress(const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_cap);
+/** @brief decompress src_len bytes of src into exactly dst_len bytes of dst. return false if src is broken */
+bool LZDecompress(const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_len);
+
+struct SwapStat {
+		/** @brief pages stored compressed */
+		size_t pages;
+		/** @brief bytes of compressed data of the pages */
+		size_t compressed_bytes;
+		/** @brief frames of the pool holding compressed data */
+		size_t pool_frames;
+		size_t swap_outs, swap_ins;
+		/** @brief pages left mapped because they hardly compressed */
+		size_t rejected;
+		/** @brief TSC cycles spent in decompressing pages for swap-ins */
+		uint64_t swap_in_cycles;
+};
+
+/** @brief store of 4 KiB pages compressed in memory (compressed swap).
+*
+*   A compressed page is an object of a size class (a multiple of kUnitBytes) in a pool frame.
+*   Pool frames hold objects of one class each. A slot ID, which identifies a pool frame and
+*   an object in it, is small enough to be kept in a not-present page table entry.
+*/
+class SwapStore {
+		public:
+				static const size_t kUnitBytes = 128;
+				/** @brief pages compressed to more than this are rejected */
+				static const size_t kMaxObjectBytes = 3072;
+				static const size_t kMaxPoolFrames = 16384;
+				static const int kSlotBits = 19;
+
+				SwapStore();
+				/** @brief compress the page and return its slot ID.
+				*
+				*   When no frame is available for the pool, the frame of the page itself is taken into
+				*   the pool and donated is set to true. The caller must not free the frame then.
+				*   kBufferTooSmall is returned if the page hardly compresses.
+				*/
+				WithError<uint64_t> Store(const void* page, FrameID frame, bool& donated);
+				/** @brief decompress the page of the slot into page and free the slot */
+				Error Load(uint64_t slot, void* page);
+				void Free(uint64_t slot);
+				SwapStat Stat() const { return stat_; }
+
+		private:
+				static const size_t kNumClasses = kMaxObjectBytes / kUnitBytes;
+				static const uint16_t kNil = 0xffff;
+
+				struct PoolFrame {
+						uint8_t* data;
+						/** @brief bit i is 1 iff object i is used */
+						uint32_t used;
+						/** @brief links of the list of frames of the same class with a free object */
+						uint16_t prev, next;
+						uint8_t size_class;
+				};
+
+				std::array<PoolFrame, kMaxPoolFrames> frames_;
+				/** @brief the first frame with a free object of each class */
+				std::array<uint16_t, kNumClasses + 1> partial_;
+				/** @brief the first unused entry of frames_, linked by next */
+				uint16_t free_frames_;
+				SwapStat stat_{};
+
+				uint8_t* ObjectOf(uint64_t slot) const;
+				void PushPartial(uint16_t index);
+				void RemovePartial(uint16_t index);
+};
+
+extern SwapStore* swap_store;
+
+/** @brief create swap_store and register SwapOutColdPages as a reclaimer of memory_manager */
+void InitializeSwap();
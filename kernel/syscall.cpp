@@ -15,6 +15,7 @@
 #include "timer.hpp"
 #include "keyboard.hpp"
 #include "app_event.hpp"
+#include "slab.hpp"
 
 namespace syscall {
 		struct Result {
@@ -22,6 +23,27 @@ namespace syscall {
 				int error;
 		};
 
+		namespace {
+				/** @brief mark the task as writing to its pages prepared by PrepareUserWrite.
+				*
+				*   CR0.WP is clear, so the kernel would write to a page which page merging has
+				*   made read-only (the zero page or a frame shared with other tasks).
+				*   Page merging skips the task while this is alive, even if it sleeps.
+				*/
+				class UserWriteScope {
+						public:
+								explicit UserWriteScope(Task& task) : task_{task} {
+										++task_.PendingUserWrites();
+								}
+								~UserWriteScope() {
+										--task_.PendingUserWrites();
+								}
+
+						private:
+								Task& task_;
+				};
+		}
+
 		#define SYSCALL(name) \
 			Result name( \
 					uint64_t arg1, uint64_t arg2, uint64_t arg3, \
@@ -69,7 +91,7 @@ namespace syscall {
 		SYSCALL(OpenWindow) {
 				const int w = arg1, h = arg2, x = arg3, y = arg4;
 				const auto title = reinterpret_cast<const char*>(arg5);
-				const auto win = std::make_shared<ToplevelWindow>(
+				const auto win = MakeSlabShared<ToplevelWindow>(
 						w, h, screen_config.pixel_format, title
 				);
 
@@ -148,6 +170,10 @@ namespace syscall {
 				return { timer_manager->CurrentTick(), kTimerFreq };
 		}
 
+		SYSCALL(ClockGetTime) {
+				return { CurrentNanoseconds(), 0 };
+		}
+
 		SYSCALL(WinRedraw) {
 				return DoWinFunc(
 						[](Window&) {
@@ -229,10 +255,14 @@ namespace syscall {
 				}
 				const auto app_events = reinterpret_cast<AppEvent*>(arg1);
 				const size_t len = arg2;
-
 				__asm__("cli");
 				auto& task = task_manager->CurrentTask();
 				__asm__("sti");
+
+				UserWriteScope user_write{task};
+				if (PrepareUserWrite(arg1, sizeof(AppEvent) * len)) {
+						return { 0, EFAULT };
+				}
 				size_t i = 0;
 
 				while (i < len) {
@@ -311,15 +341,38 @@ namespace syscall {
 				const uint64_t task_id = task_manager->CurrentTask().ID();
 				__asm__("sti");
 
-				unsigned long timeout = arg3 * kTimerFreq / 1000;
+				// timeout in ms, or in ns if bit 1 of mode is set
+				const unsigned long ns_per_unit = (mode & 2) ? 1 : kNanosecondsPerSecond / 1000;
+				unsigned long timeout = arg3 * ns_per_unit;
 				if (mode & 1) { // relative
-						timeout += timer_manager->CurrentTick();
+						timeout += CurrentNanoseconds();
+				}
+
+				__asm__("cli");
+				const auto [ handle, err ] = timer_manager->AddTimer(Timer{timeout, -timer_value, task_id});
+				__asm__("sti");
+				if (err) {
+						return { 0, ENOMEM };
+				}
+				return { timeout / ns_per_unit, 0};
+		}
+
+		SYSCALL(CancelTimer) {
+				// cancel the timers of the value, or all the timers of the app if it is 0
+				const int timer_value = arg1;
+				if (timer_value < 0) {
+						return { 0, EINVAL };
 				}
 
 				__asm__("cli");
-				timer_manager->AddTimer(Timer{timeout, -timer_value, task_id});
+				const uint64_t task_id = task_manager->CurrentTask().ID();
 				__asm__("sti");
-				return { timeout * 1000 / kTimerFreq, 0};
+
+				const size_t num_cancelled = timer_manager->CancelTimersIf(
+						task_id, [timer_value](const Timer& t) {
+								return timer_value == 0 ? t.Value() < 0 : t.Value() == -timer_value;
+						});
+				return { num_cancelled, 0 };
 		}
 
 		namespace {
@@ -373,7 +426,7 @@ namespace syscall {
 				}
 
 				size_t fd = AllocateFD(task);
-				task.Files()[fd] = std::make_unique<fat::FileDescriptor>(*file);
+				task.Files()[fd] = MakeSlabShared<fat::FileDescriptor>(*file);
 				return { fd, 0 };
 		}
 
@@ -388,25 +441,32 @@ namespace syscall {
 				if (fd < 0 || task.Files().size() <= fd || !task.Files()[fd]) {
 						return { 0, EBADF };
 				}
+				UserWriteScope user_write{task};
+				if (PrepareUserWrite(arg2, count)) {
+						return { 0, EFAULT };
+				}
 				return { task.Files()[fd]->Read(buf, count), 0 };
 		}
 
 		SYSCALL(DemandPages) {
 				const size_t num_pages = arg1;
-				// const int flags = arg2;
+				const int flags = arg2;
 				__asm__("cli");
 				auto& task = task_manager->CurrentTask();
 				__asm__("sti");
 
-				const uint64_t dp_end = task.DPagingEnd();
-				task.SetDPagingEnd(dp_end + 4096 * num_pages);
-				return { dp_end, 0 };
+				auto [ begin, err ] =
+						task.AddrSpace().ExtendDemandPaging(4096 * num_pages, flags & 1); // huge pages
+				if (err) {
+						return { 0, ENOMEM };
+				}
+				return { begin, 0 };
 		}
 
 		SYSCALL(MapFile) {
 				const int fd = arg1;
 				size_t* file_size = reinterpret_cast<size_t*>(arg2);
-				// const int flags = arg3;
+				const int flags = arg3;
 				__asm__("cli");
 				auto& task = task_manager->CurrentTask();
 				__asm__("sti");
@@ -415,14 +475,76 @@ namespace syscall {
 						return { 0, EBADF };
 				}
 
+				UserWriteScope user_write{task};
+				if (PrepareUserWrite(arg2, sizeof(size_t))) {
+						return { 0, EFAULT };
+				}
 				*file_size = task.Files()[fd]->Size();
-				const uint64_t vaddr_end = task.FileMapEnd();
-				const uint64_t vaddr_begin = (vaddr_end - *file_size) & 0xffff'ffff'ffff'f000;
-				task.SetFileMapEnd(vaddr_begin);
-				task.FileMaps().push_back(FileMapping{fd, vaddr_begin, vaddr_end});
+				auto [ vaddr_begin, err ] =
+						task.AddrSpace().MapFile(task.Files()[fd], flags & 1); // shared
+				if (err.Cause() == Error::kInvalidFile) {
+						return { 0, EINVAL };
+				} else if (err) {
+						return { 0, ENOMEM };
+				}
 				return { vaddr_begin, 0 };
 		}
 
+		SYSCALL(UnmapPages) {
+				const uint64_t addr = arg1;
+				const size_t len = arg2;
+				if (addr % 4096 != 0) {
+						return { 0, EINVAL };
+				}
+				__asm__("cli");
+				auto& task = task_manager->CurrentTask();
+				__asm__("sti");
+
+				const size_t num_bytes = (len + 4095) & ~static_cast<size_t>(4095);
+				if (auto err = task.AddrSpace().Unmap(addr, num_bytes)) {
+						return { 0, EINVAL };
+				}
+				return { 0, 0 };
+		}
+
+		SYSCALL(AdvisePages) {
+				const uint64_t addr = arg1;
+				const size_t len = arg2;
+				const int advice = arg3;
+				if (addr % 4096 != 0) {
+						return { 0, EINVAL };
+				}
+				if (advice != 1) { // dont need
+						return { 0, EINVAL };
+				}
+				__asm__("cli");
+				auto& task = task_manager->CurrentTask();
+				__asm__("sti");
+
+				const size_t num_bytes = (len + 4095) & ~static_cast<size_t>(4095);
+				if (auto err = task.AddrSpace().Discard(addr, num_bytes)) {
+						return { 0, EINVAL };
+				}
+				return { 0, 0 };
+		}
+
+		SYSCALL(SyncPages) {
+				const uint64_t addr = arg1;
+				const size_t len = arg2;
+				if (addr % 4096 != 0) {
+						return { 0, EINVAL };
+				}
+				__asm__("cli");
+				auto& task = task_manager->CurrentTask();
+				__asm__("sti");
+
+				const size_t num_bytes = (len + 4095) & ~static_cast<size_t>(4095);
+				if (auto err = task.AddrSpace().Sync(addr, num_bytes)) {
+						return { 0, EINVAL };
+				}
+				return { 0, 0 };
+		}
+
 		#undef SYSCALL
 
 } // namespace syscall
@@ -430,7 +552,7 @@ namespace syscall {
 using SyscallFuncType = syscall::Result (uint64_t, uint64_t, uint64_t,
 																					uint64_t, uint64_t, uint64_t);
 
-extern "C" std::array<SyscallFuncType*, 0x10> syscall_table{
+extern "C" std::array<SyscallFuncType*, 0x15> syscall_table{
 		/* 0x00 */ syscall::LogString,
 		/* 0x01 */ syscall::PutString,
 		/* 0x02 */ syscall::Exit,
@@ -447,6 +569,11 @@ extern "C" std::array<SyscallFuncType*, 0x10> syscall_table{
 		/* 0x0d */ syscall::ReadFile,
 		/* 0x0e */ syscall::DemandPages,
 		/* 0x0f */ syscall::MapFile,
+		/* 0x10 */ syscall::UnmapPages,
+		/* 0x11 */ syscall::AdvisePages,
+		/* 0x12 */ syscall::SyncPages,
+		/* 0x13 */ syscall::ClockGetTime,
+		/* 0x14 */ syscall::CancelTimer,
 };
 
 void InitializeSyscall() {
@@ -1,6 +1,8 @@
 #include "task.hpp"
 
 #include "asmfunc.h"
+#include "interrupt.hpp"
+#include "memory_manager.hpp"
 #include "segment.hpp"
 #include "timer.hpp"
 
@@ -11,8 +13,18 @@ namespace {
         c.erase(it, c.end());
     }
 
+    /** @brief index of the slot of TaskManager which holds the task of the ID */
+    size_t TaskSlotIndex(uint64_t id) {
+        return (id & ((uint64_t{1} << TaskManager::kTaskSlotBits) - 1)) - 1;
+    }
+
     void TaskIdle(uint64_t task_id, int64_t data) {
-        while (true) __asm__("hlt");
+        while (true) {
+            // zero-fill frames in advance while no other task runs
+            if (!FillZeroFramePool()) {
+                __asm__("hlt");
+            }
+        }
     }
 } // namespace
 
@@ -82,32 +94,8 @@ std::vector<std::shared_ptr<::FileDescriptor>>& Task::Files() {
 		return files_;
 }
 
-uint64_t Task::DPagingBegin() const {
-		return dpaging_begin_;
-}
-
-void Task::SetDPagingBegin(uint64_t v) {
-		dpaging_begin_ = v;
-}
-
-uint64_t Task::DPagingEnd() const {
-		return dpaging_end_;
-}
-
-void Task::SetDPagingEnd(uint64_t v) {
-		dpaging_end_ = v;
-}
-
-uint64_t Task::FileMapEnd() const {
-		return file_map_end_;
-}
-
-void Task::SetFileMapEnd(uint64_t v) {
-		file_map_end_ = v;
-}
-
-std::vector<FileMapping>& Task::FileMaps() {
-		return file_maps_;
+AddressSpace& Task::AddrSpace() {
+		return address_space_;
 }
 
 TaskManager::TaskManager() {
@@ -124,8 +112,20 @@ TaskManager::TaskManager() {
 }
 
 Task& TaskManager::NewTask() {
-    ++latest_id_;
-    return *tasks_.emplace_back(new Task{latest_id_});
+    // interrupt handlers look up the table
+    InterruptGuard guard;
+    size_t slot_index = tasks_.size();
+    if (free_slots_.empty()) {
+        tasks_.push_back(TaskSlot{nullptr, 0});
+    } else {
+        slot_index = free_slots_.back();
+        free_slots_.pop_back();
+    }
+
+    auto& slot = tasks_[slot_index];
+    const uint64_t id = (slot.generation << kTaskSlotBits) | (slot_index + 1);
+    slot.task.reset(new Task{id});
+    return *slot.task;
 }
 
 void TaskManager::SwitchTask(const TaskContext& current_ctx) {
@@ -154,13 +154,12 @@ void TaskManager::Sleep(Task* task) {
 }
 
 Error TaskManager::Sleep(uint64_t id) {
-    auto it = std::find_if(tasks_.begin(), tasks_.end(),
-                            [id](const auto& t){ return t->ID() == id; });
-    if (it == tasks_.end()) {
+    Task* task = FindTask(id);
+    if (task == nullptr) {
         return MAKE_ERROR(Error::kNoSuchTask);
     }
 
-    Sleep(it->get());
+    Sleep(task);
     return MAKE_ERROR(Error::kSuccess);
 }
 
@@ -181,28 +180,38 @@ void TaskManager::Wakeup(Task* task, int level) {
     if (level > current_level_) {
         level_changed_ = true;
     }
+    // the task timer may be stopped while idle
+    timer_manager->StartTaskTimer();
     return;
 }
 
+Task* TaskManager::FindTask(uint64_t id) {
+    const size_t slot_index = TaskSlotIndex(id);
+    if (slot_index >= tasks_.size()) {
+        return nullptr;
+    }
+    Task* task = tasks_[slot_index].task.get();
+    // the slot may hold a later task or nothing once the task of the ID has finished
+    return task != nullptr && task->ID() == id ? task : nullptr;
+}
+
 Error TaskManager::Wakeup(uint64_t id, int level) {
-    auto it = std::find_if(tasks_.begin(), tasks_.end(),
-                            [id](const auto& t){ return t->ID() == id; });
-    if (it == tasks_.end()) {
+    Task* task = FindTask(id);
+    if (task == nullptr) {
         return MAKE_ERROR(Error::kNoSuchTask);
     }
 
-    Wakeup(it->get(), level);
+    Wakeup(task, level);
     return MAKE_ERROR(Error::kSuccess);
 }
 
 Error TaskManager::SendMessage(uint64_t id, const Message& msg) {
-    auto it = std::find_if(tasks_.begin(), tasks_.end(),
-                            [id](const auto& t){ return t->ID() == id; });
-    if (it == tasks_.end()) {
+    Task* task = FindTask(id);
+    if (task == nullptr) {
         return MAKE_ERROR(Error::kNoSuchTask);
     }
 
-    (*it)->SendMessage(msg);
+    task->SendMessage(msg);
     return MAKE_ERROR(Error::kSuccess);
 }
 
@@ -210,15 +219,25 @@ Task& TaskManager::CurrentTask() {
     return *running_[current_level_].front();
 }
 
+bool TaskManager::Idle() const {
+    size_t num_running = 0;
+    for (const auto& queue : running_) {
+        num_running += queue.size();
+    }
+    return num_running <= 1;
+}
+
 void TaskManager::Finish(int exit_code) {
 		Task* current_task = RotateCurrentRunQueue(true);
 
 		const auto task_id = current_task->ID();
-		auto it = std::find_if(
-				tasks_.begin(), tasks_.end(),
-				[current_task](const auto& t){ return t.get() == current_task; }
-		);
-		tasks_.erase(it);
+		// timers of the finished task would be sent to nobody
+		timer_manager->CancelTimers(task_id);
+		const size_t slot_index = TaskSlotIndex(task_id);
+		auto& slot = tasks_[slot_index];
+		slot.task.reset();
+		++slot.generation;
+		free_slots_.push_back(slot_index);
 
 		finish_tasks_[task_id] = exit_code;
 		if (auto it = finish_waiter_.find(task_id); it != finish_waiter_.end()) {
@@ -302,11 +321,7 @@ TaskManager* task_manager;
 void InitializeTask() {
     task_manager = new TaskManager;
 
-    __asm__("cli");
-    timer_manager->AddTimer(
-        Timer{timer_manager->CurrentTick() + kTaskTimerPeriod, kTaskTimerValue, 1}
-    );
-    __asm__("sti");
+    timer_manager->StartTaskTimer();
 }
 
 __attribute__((no_caller_saved_registers))
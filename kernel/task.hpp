@@ -12,10 +12,13 @@
 #include <optional>
 #include <vector>
 
+#include "address_space.hpp"
 #include "error.hpp"
 #include "message.hpp"
 #include "paging.hpp"
 #include "fat.hpp"
+#include "slab.hpp"
+#include "timer.hpp"
 
 struct TaskContext {
     uint64_t cr3, rip, rflags, reserved1; // offset 0x00
@@ -29,12 +32,7 @@ using TaskFunc = void (uint64_t, int64_t);
 
 class TaskManager;
 
-struct FileMapping {
-		int fd;
-		uint64_t vaddr_begin, vaddr_end;
-};
-
-class Task {
+class Task : public SlabObject {
     public:
         static const int kDefaultLevel = 1;
         static const size_t kDefaultStackBytes = 8 * 4096;
@@ -49,13 +47,12 @@ class Task {
         void SendMessage(const Message& msg);
         std::optional<Message> ReceiveMessage();
 				std::vector<std::shared_ptr<::FileDescriptor>>& Files();
-				uint64_t DPagingBegin() const;
-				void SetDPagingBegin(uint64_t v);
-				uint64_t DPagingEnd() const;
-				void SetDPagingEnd(uint64_t v);
-				uint64_t FileMapEnd() const;
-				void SetFileMapEnd(uint64_t v);
-				std::vector<FileMapping>& FileMaps();
+				AddressSpace& AddrSpace();
+				PageFaultStat& FaultStat() { return fault_stat_; }
+				/** @brief the number of syscalls of the task between PrepareUserWrite and its writes.
+				*   page merging does not make pages of the task read-only meanwhile. */
+				unsigned int& PendingUserWrites() { return pending_user_writes_; }
+				TaskTimers& Timers() { return timers_; }
 
         int Level() const { return level_; }
         bool Running() const { return running_; }
@@ -65,13 +62,14 @@ class Task {
         std::vector<uint64_t> stack_;
         alignas(16) TaskContext context_;
 				uint64_t os_stack_ptr_;
-        std::deque<Message> msgs_;
+        std::deque<Message, SlabAllocator<Message>> msgs_;
         unsigned int level_{kDefaultLevel};
         bool running_{false};
 				std::vector<std::shared_ptr<::FileDescriptor>> files_{};
-				uint64_t dpaging_begin_{0}, dpaging_end_{0};
-				uint64_t file_map_end_{0};
-				std::vector<FileMapping> file_maps_{};
+				AddressSpace address_space_{};
+				PageFaultStat fault_stat_{};
+				unsigned int pending_user_writes_{0};
+				TaskTimers timers_{};
 
         Task& SetLevel(int level) { level_ = level; return *this; }
         Task& SetRunning(bool running) { running_ = running; return *this; }
@@ -83,6 +81,8 @@ class TaskManager {
     public:
         // level: 0 = lowest, kMaxLevel = highest
         static const int kMaxLevel = 3;
+        /** @brief a task ID is (generation << kTaskSlotBits) | (index of its slot + 1) */
+        static const int kTaskSlotBits = 20;
 
         TaskManager();
         Task& NewTask();
@@ -94,12 +94,39 @@ class TaskManager {
         Error Wakeup(uint64_t id, int level = -1);
         Error SendMessage(uint64_t id, const Message& msg);
         Task& CurrentTask();
+        /** @brief return true if no task but the idle task is runnable */
+        bool Idle() const;
+        /** @brief return the task of the ID in constant time, or nullptr if it has finished */
+        Task* FindTask(uint64_t id);
+        /** @brief call f(task, slot index) for every task in the order of slot from first_slot.
+        *
+        *   Task IDs do not increase in the order because slots are reused,
+        *   so a caller resuming an iteration should keep the slot index instead of the ID.
+        */
+        template <class F>
+        void ForEachTask(F f, size_t first_slot = 0) {
+            for (size_t i = first_slot; i < tasks_.size(); ++i) {
+                if (tasks_[i].task) {
+                    f(*tasks_[i].task, i);
+                }
+            }
+        }
 				void Finish(int exit_code);
 				WithError<int> WaitFinish(uint64_t task_id);
     
     private:
-        std::vector<std::unique_ptr<Task>> tasks_{};
-        uint64_t latest_id_{0};
+        /** @brief an entry of the task table indexed by the lower kTaskSlotBits of task IDs.
+        *
+        *   The generation is advanced when the task finishes, so that the old ID no longer
+        *   matches the ID of the next task in the slot.
+        */
+        struct TaskSlot {
+            std::unique_ptr<Task> task;
+            uint64_t generation;
+        };
+        std::vector<TaskSlot> tasks_{};
+        /** @brief indices of the slots whose tasks have finished */
+        std::vector<size_t> free_slots_{};
         std::array<std::deque<Task*>, kMaxLevel + 1> running_{};
         int current_level_{kMaxLevel};
         bool level_changed_{false};
@@ -2,6 +2,7 @@
 
 #include <cstring>
 #include <cctype>
+#include <cstdlib>
 #include <limits>
 
 #include "font.hpp"
@@ -11,6 +12,12 @@
 #include "elf.hpp"
 #include "memory_manager.hpp"
 #include "paging.hpp"
+#include "slab.hpp"
+#include "heap.hpp"
+#include "image_cache.hpp"
+#include "page_cache.hpp"
+#include "swap.hpp"
+#include "page_merge.hpp"
 #include "timer.hpp"
 #include "keyboard.hpp"
 #include "logger.hpp"
@@ -86,7 +93,7 @@ namespace {
 
     static_assert(kBytesPerFrame >= 4096);
 
-    WithError<uint64_t> CopyLoadSegments(Elf64_Ehdr* ehdr) {
+    WithError<uint64_t> CopyLoadSegments(Elf64_Ehdr* ehdr, std::vector<VMA>& segments) {
         auto phdr = GetProgramHeader(ehdr);
 				uint64_t last_addr = 0;
         for (int i = 0; i < ehdr->e_phnum; ++i) {
@@ -97,6 +104,19 @@ namespace {
 						last_addr = std::max(last_addr, phdr[i].p_vaddr + phdr[i].p_memsz);
             const auto num_4kpages = (phdr[i].p_memsz + 4095) / 4096;
 
+						const uint64_t page_begin = phdr[i].p_vaddr & ~static_cast<uint64_t>(4095);
+						const uint64_t page_end = (phdr[i].p_vaddr + phdr[i].p_memsz + 4095) & ~static_cast<uint64_t>(4095);
+						const bool writable = phdr[i].p_flags & PF_W;
+						if (!segments.empty() &&
+								page_begin < segments.back().begin + segments.back().size) {
+								auto& prev = segments.back();
+								prev.size = std::max(prev.begin + prev.size, page_end) - prev.begin;
+								prev.writable |= writable;
+						} else {
+								segments.push_back(VMA{VMA::kImage, page_begin, page_end - page_begin,
+																			 writable, nullptr});
+						}
+
             // setup pagemaps as readonly (writable = false)
 						if (auto err = SetupPageMaps(dest_addr, num_4kpages, false)) {
                 return { last_addr, err };
@@ -110,7 +130,7 @@ namespace {
         return { last_addr, MAKE_ERROR(Error::kSuccess) };
     }
 
-    WithError<uint64_t> LoadELF(Elf64_Ehdr* ehdr) {
+    WithError<uint64_t> LoadELF(Elf64_Ehdr* ehdr, std::vector<VMA>& segments) {
         if (ehdr->e_type != ET_EXEC) {
             return { 0, MAKE_ERROR(Error::kInvalidFormat) };
         }
@@ -120,9 +140,45 @@ namespace {
             return { 0, MAKE_ERROR(Error::kInvalidFormat) };
         }
 
-        return CopyLoadSegments(ehdr);
+        return CopyLoadSegments(ehdr, segments);
     }
 
+		/** @brief make areas whose pages are read from the file on first access for LOAD segments.
+		*
+		*		Bytes between p_filesz and p_memsz (.bss) are zero-filled on demand.
+		*		kNotImplemented is returned if segments cannot be mapped page by page from the file,
+		*		i.e. a page is shared by segments or a file offset is not congruent with the address.
+		*/
+		WithError<uint64_t> MapLoadSegments(const std::vector<Elf64_Phdr>& phdrs,
+																				std::shared_ptr<FileDescriptor> file,
+																				std::vector<VMA>& segments) {
+				uint64_t last_addr = 0;
+				for (const auto& phdr : phdrs) {
+						if (phdr.p_type != PT_LOAD) continue;
+
+						if (phdr.p_vaddr < 0xffff'8000'0000'0000) {
+								return { 0, MAKE_ERROR(Error::kInvalidFormat) };
+						}
+						if (phdr.p_vaddr % 4096 != phdr.p_offset % 4096) {
+								return { 0, MAKE_ERROR(Error::kNotImplemented) };
+						}
+						const uint64_t page_begin = phdr.p_vaddr & ~static_cast<uint64_t>(4095);
+						const uint64_t page_end =
+							(phdr.p_vaddr + phdr.p_memsz + 4095) & ~static_cast<uint64_t>(4095);
+						if (!segments.empty() &&
+								page_begin < segments.back().begin + segments.back().size) {
+								return { 0, MAKE_ERROR(Error::kNotImplemented) };
+						}
+
+						const uint64_t head = phdr.p_vaddr - page_begin;
+						segments.push_back(VMA{VMA::kImage, page_begin, page_end - page_begin,
+																	 static_cast<bool>(phdr.p_flags & PF_W), FillFilePage,
+																	 file, phdr.p_offset - head, head + phdr.p_filesz});
+						last_addr = std::max(last_addr, phdr.p_vaddr + phdr.p_memsz);
+				}
+				return { last_addr, MAKE_ERROR(Error::kSuccess) };
+		}
+
 
 		WithError<PageMapEntry*> SetupPML4(Task& current_task) {
 				auto pml4 = NewPageMap();
@@ -130,10 +186,16 @@ namespace {
 						return pml4;
 				}
 
-				const auto current_pml4 = reinterpret_cast<PageMapEntry*>(GetCR3());
+				const auto current_pml4 = CurrentPML4();
 				memcpy(pml4.value, current_pml4, 256 * sizeof(uint64_t));
 
-				const auto cr3 = reinterpret_cast<uint64_t>(pml4.value);
+				auto [ cr3, err ] = NewCR3(pml4.value);
+				if (err) {
+						FreePageMap(pml4.value);
+						return { nullptr, err };
+				}
+				// a page map replaced here (used to load an app) is not switched to any more
+				FreeCR3(current_task.Context().cr3);
 				SetCR3(cr3);
 				current_task.Context().cr3 = cr3;
 				return pml4;
@@ -144,7 +206,21 @@ namespace {
 				current_task.Context().cr3 = 0;
 				ResetCR3();
 
-				return FreePageMap(reinterpret_cast<PageMapEntry*>(cr3));
+				FreeCR3(cr3);
+				return FreePageMap(PML4OfCR3(cr3));
+		}
+
+		/** @brief free the page map set by SetupPML4 together with the pages mapped in its user half.
+		*
+		*   This is for LoadApp failing before the pages are registered to the address space as VMAs.
+		*/
+		Error DiscardPML4(Task& current_task) {
+				const auto cr3 = current_task.Context().cr3;
+				current_task.Context().cr3 = 0;
+				ResetCR3();
+
+				FreeCR3(cr3);
+				return FreePageMaps(PML4OfCR3(cr3));
 		}
 
 		void ListAllEntries(FileDescriptor& fd, uint32_t dir_cluster) {
@@ -172,21 +248,68 @@ namespace {
 				}
 		}
 
+		/** @brief load the app into a new page map set to the task by SetupPML4.
+		*
+		*		On failure the page map of the task is not replaced, or is discarded with its pages.
+		*/
 		WithError<AppLoadInfo> LoadApp(fat::DirectoryEntry& file_entry, Task& task) {
-				PageMapEntry* temp_pml4;
-				if (auto [ pml4, err ] = SetupPML4(task); err) {
-						return { {}, err };
-				} else {
-						temp_pml4 = pml4;
+				if (auto cached = image_cache->Find(file_entry)) {
+						AppLoadInfo app_load = *cached;
+						auto [ pml4, err ] = SetupPML4(task);
+						if (err) {
+								if (app_load.pml4) {
+										image_cache->Unpin(app_load.pml4);
+								}
+								return { {}, err };
+						}
+						if (app_load.pml4 == nullptr) { // mapped lazily
+								app_load.pml4 = pml4;
+								return { app_load, MAKE_ERROR(Error::kSuccess) };
+						}
+						// the entry is pinned by Find, so reclaiming memory while copying does not free it
+						err = CopyPageMaps(pml4, app_load.pml4, 4, 256);
+						image_cache->Unpin(app_load.pml4);
+						if (err) {
+								// release the tables and frame references copied so far
+								DiscardPML4(task);
+								return { {}, err };
+						}
+						app_load.pml4 = pml4;
+						return { app_load, MAKE_ERROR(Error::kSuccess) };
 				}
 
-				if (auto it = app_loads->find(&file_entry); it != app_loads->end()) {
-						AppLoadInfo app_load = it->second;
-						auto err = CopyPageMaps(temp_pml4, app_load.pml4, 4, 256);
-						app_load.pml4 = temp_pml4;
-						return { app_load, err };
+				// read only headers. segments are read when the app touches them.
+				auto file = MakeSlabShared<fat::FileDescriptor>(file_entry);
+				Elf64_Ehdr ehdr;
+				if (file->Load(&ehdr, sizeof(ehdr), 0) != sizeof(ehdr) ||
+						memcmp(ehdr.e_ident, "\x7f" "ELF", 4) != 0) {
+						return { {}, MAKE_ERROR(Error::kInvalidFile) };
+				}
+				if (ehdr.e_type != ET_EXEC || ehdr.e_phentsize != sizeof(Elf64_Phdr)) {
+						return { {}, MAKE_ERROR(Error::kInvalidFormat) };
+				}
+				std::vector<Elf64_Phdr> phdrs(ehdr.e_phnum);
+				const size_t phdrs_bytes = sizeof(Elf64_Phdr) * phdrs.size();
+				if (file->Load(phdrs.data(), phdrs_bytes, ehdr.e_phoff) != phdrs_bytes) {
+						return { {}, MAKE_ERROR(Error::kInvalidFormat) };
 				}
 
+				std::vector<VMA> segments;
+				if (auto [ last_addr, err ] = MapLoadSegments(phdrs, file, segments); !err) {
+						auto [ pml4, err_pml4 ] = SetupPML4(task);
+						if (err_pml4) {
+								return { {}, err_pml4 };
+						}
+						AppLoadInfo app_load{last_addr, ehdr.e_entry, nullptr, segments};
+						image_cache->Insert(file_entry, app_load);
+						app_load.pml4 = pml4;
+						return { app_load, MAKE_ERROR(Error::kSuccess) };
+				} else if (err.Cause() != Error::kNotImplemented) {
+						return { {}, err };
+				}
+
+				// fall back to copying all the segments at once
+				segments.clear();
 				std::vector<uint8_t> file_buf(file_entry.file_size);
 				fat::LoadFile(&file_buf[0], file_buf.size(), file_entry);
 
@@ -195,21 +318,35 @@ namespace {
 						return { {}, MAKE_ERROR(Error::kInvalidFile) };
 				}
 
-				auto [ last_addr, err_load ] = LoadELF(elf_header);
+				PageMapEntry* temp_pml4;
+				if (auto [ pml4, err ] = SetupPML4(task); err) {
+						return { {}, err };
+				} else {
+						temp_pml4 = pml4;
+				}
+
+				auto [ last_addr, err_load ] = LoadELF(elf_header, segments);
 				if (err_load) {
+						DiscardPML4(task);
 						return { {}, err_load };
 				}
 
-				AppLoadInfo app_load{last_addr, elf_header->e_entry, temp_pml4};
-				app_loads->insert(std::make_pair(&file_entry, app_load));
-
-				if (auto [ pml4, err ] = SetupPML4(task); err) {
-						return { app_load, err };
-				} else {
-						app_load.pml4 = pml4;
+				auto [ pml4, err ] = SetupPML4(task);
+				if (err) {
+						// temp_pml4 is still the page map of the task. do not give it to the cache.
+						DiscardPML4(task);
+						return { {}, err };
 				}
-				auto err = CopyPageMaps(app_load.pml4, temp_pml4, 4, 256);
-				return { app_load, err };
+				AppLoadInfo app_load{last_addr, elf_header->e_entry, pml4, segments};
+				err = CopyPageMaps(pml4, temp_pml4, 4, 256);
+				// the cache takes temp_pml4 over. it may free the page map at once if it is too large.
+				image_cache->Insert(file_entry,
+						AppLoadInfo{last_addr, elf_header->e_entry, temp_pml4, segments});
+				if (err) {
+						DiscardPML4(task);
+						return { {}, err };
+				}
+				return { app_load, MAKE_ERROR(Error::kSuccess) };
 		}
 
 		fat::DirectoryEntry* FindCommand(const char* command,
@@ -237,8 +374,6 @@ namespace {
 
 } // namespace
 
-std::map<fat::DirectoryEntry*, AppLoadInfo>* app_loads;
-
 Terminal::Terminal(Task& task, const TerminalDescriptor* term_desc)
 				: task_{task} {
 		if (term_desc) {
@@ -249,11 +384,11 @@ Terminal::Terminal(Task& task, const TerminalDescriptor* term_desc)
 		} else {
 				show_window_ = true;
 				for (int i=0; i < files_.size(); ++i) {
-						files_[i] = std::make_shared<TerminalFileDescriptor>(*this);
+						files_[i] = MakeSlabShared<TerminalFileDescriptor>(*this);
 				}
 		}
 		if (show_window_) {
-				window_ = std::make_shared<ToplevelWindow>(
+				window_ = MakeSlabShared<ToplevelWindow>(
 						kColumns * 8 + 8 + ToplevelWindow::kMarginX,
 						kRows * 16 + 8 + ToplevelWindow::kMarginY,
 						screen_config.pixel_format,
@@ -413,7 +548,7 @@ void Terminal::ExecuteLine() {
 						PrintToFD(*files_[2], "cannot redirect to a directory\n");
 						return;
 				}
-				files_[1] = std::make_shared<fat::FileDescriptor>(*file);
+				files_[1] = MakeSlabShared<fat::FileDescriptor>(*file);
 		}
 
 		std::shared_ptr<PipeDescriptor> pipe_fd;
@@ -427,7 +562,7 @@ void Terminal::ExecuteLine() {
 				}
 
 				auto& subtask = task_manager->NewTask();
-				pipe_fd = std::make_shared<PipeDescriptor>(subtask);
+				pipe_fd = MakeSlabShared<PipeDescriptor>(subtask);
 				auto term_desc = new TerminalDescriptor{
 						subcommand, true, false,
 						{ pipe_fd, files_[1], files_[2] }
@@ -511,7 +646,7 @@ void Terminal::ExecuteLine() {
 								PrintToFD(*files_[2], "%s is a directory\n", name);
 								exit_code = 1;
 						} else {
-								fd = std::make_shared<fat::FileDescriptor>(*file_entry);
+								fd = MakeSlabShared<fat::FileDescriptor>(*file_entry);
 						}
 				}
 				if (fd) {
@@ -554,6 +689,67 @@ void Terminal::ExecuteLine() {
 				PrintToFD(*files_[1], "Phys total: %lu frames (%llu MiB)\n",
 						p_stat.total_frames,
 						p_stat.total_frames * kBytesPerFrame / 1024 / 1024);
+				const auto z_stat = GetZeroFramePoolStat();
+				PrintToFD(*files_[1], "Zero pool : %lu frames, hit %lu, miss %lu\n",
+						z_stat.frames, z_stat.hits, z_stat.misses);
+				const auto h_stat = GetHeapStat();
+				PrintToFD(*files_[1], "Heap used : %lu KiB, mapped %lu KiB, high water %lu KiB\n",
+						h_stat.used_bytes / 1024, h_stat.mapped_bytes / 1024,
+						h_stat.high_water_bytes / 1024);
+				const auto i_stat = image_cache->Stat();
+				PrintToFD(*files_[1], "App cache : %lu apps, %lu KiB / %lu KiB, hit %lu/%lu (%lu%%)\n",
+						i_stat.entries, i_stat.resident_bytes / 1024, i_stat.budget_bytes / 1024,
+						i_stat.hits, i_stat.lookups,
+						i_stat.lookups == 0 ? 0 : 100 * i_stat.hits / i_stat.lookups);
+				PrintToFD(*files_[1], "            evicted %lu, invalidated %lu\n",
+						i_stat.evictions, i_stat.invalidations);
+				PrintToFD(*files_[1], "Page cache: %lu pages of shared file maps\n", page_cache->NumPages());
+				const auto s_stat = swap_store->Stat();
+				PrintToFD(*files_[1], "Swap      : %lu pages in %lu KiB (%lu frames), ratio %lu.%02lu\n",
+						s_stat.pages, s_stat.compressed_bytes / 1024, s_stat.pool_frames,
+						s_stat.compressed_bytes == 0 ? 0 : s_stat.pages * 4096 / s_stat.compressed_bytes,
+						s_stat.compressed_bytes == 0 ? 0 : s_stat.pages * 409600 / s_stat.compressed_bytes % 100);
+				PrintToFD(*files_[1], "            out %lu, in %lu (avg %lu cycles), rejected %lu\n",
+						s_stat.swap_outs, s_stat.swap_ins,
+						s_stat.swap_ins == 0 ? 0 : s_stat.swap_in_cycles / s_stat.swap_ins,
+						s_stat.rejected);
+				const auto m_stat = GetPageMergeStat();
+				PrintToFD(*files_[1], "Merged    : %lu frames saved in %lu frames, %lu merges, %lu zero pages\n",
+						m_stat.frames_saved, m_stat.merged_frames, m_stat.merges, m_stat.zero_pages);
+				PrintToFD(*files_[1], "            %lu pages scanned, %lu full scans\n",
+						m_stat.pages_scanned, m_stat.full_scans);
+				PrintToFD(*files_[1], "Free blocks (order:count)");
+				for (int order = 0; order <= kMaxFrameOrder; ++order) {
+						PrintToFD(*files_[1], "%s%d:%lu", order % 6 == 0 ? "\n  " : " ",
+								order, p_stat.free_blocks[order]);
+				}
+				PrintToFD(*files_[1], "\n");
+		} else if (strcmp(command, "slabstat") == 0) {
+				PrintToFD(*files_[1], "cache     in use  cached   total slabs   allocs hit%%\n");
+				for (int i = 0; i < kNumSlabSizeClasses; ++i) {
+						const auto s_stat = SlabSizeClassStat(i);
+						const size_t hit_percent = s_stat.allocations == 0 ? 0 :
+								100 * s_stat.magazine_hits / s_stat.allocations;
+						PrintToFD(*files_[1], "%-8s %7lu %7lu %7lu %5lu %8lu %3lu%%\n",
+								s_stat.name, s_stat.objects_in_use, s_stat.objects_cached,
+								s_stat.objects_total, s_stat.slabs, s_stat.allocations, hit_percent);
+				}
+		} else if (strcmp(command, "faultstat") == 0) {
+				// counters of the last app run in this terminal
+				const auto& f_stat = task_manager->CurrentTask().FaultStat();
+				PrintToFD(*files_[1], "Faults     : %lu (copy-on-write %lu)\n",
+						f_stat.faults, f_stat.copy_on_write);
+				PrintToFD(*files_[1], "Pages      : %lu mapped, %lu ahead of access, %lu resident\n",
+						f_stat.pages_mapped, f_stat.pages_around, f_stat.resident_pages);
+				PrintToFD(*files_[1], "Zero pages : %lu\n", f_stat.zero_pages);
+				PrintToFD(*files_[1], "Write-back : %lu pages\n", f_stat.pages_written_back);
+				PrintToFD(*files_[1], "Swap-in    : %lu pages\n", f_stat.swap_ins);
+				PrintToFD(*files_[1], "Huge pages : %lu\n", f_stat.huge_pages);
+		} else if (strcmp(command, "faultaround") == 0) {
+				if (first_arg) {
+						SetFaultAroundPages(strtoul(first_arg, nullptr, 0));
+				}
+				PrintToFD(*files_[1], "fault-around window: %lu pages\n", FaultAroundPages());
 		} else if (command[0] != 0) {
         auto file_entry = FindCommand(command);
         if (!file_entry) {
@@ -598,8 +794,31 @@ WithError<int> Terminal::ExecuteFile(fat::DirectoryEntry& file_entry,
 				return { 0, err };
 		}
 
+		task.FaultStat() = {};
+		auto& addr_space = task.AddrSpace();
+		// every path after LoadApp comes here. VMAs left in addr_space would make
+		// the next app in this terminal fail with kAlreadyAllocated.
+		auto cleanup = [&task, &addr_space]() {
+				const auto err_clear = addr_space.Clear();
+				const auto err_free = FreePML4(task);
+				return err_clear ? err_clear : err_free;
+		};
+
+		for (const auto& segment : app_load.segments) {
+				if (auto err = addr_space.Add(segment)) {
+						cleanup();
+						return { 0, err };
+				}
+		}
+
 		LinearAddress4Level args_frame_addr{0xffff'ffff'ffff'f000};
 		if (auto err = SetupPageMaps(args_frame_addr, 1)) {
+				cleanup();
+				return { 0, err };
+		}
+		if (auto err = addr_space.Add(VMA{VMA::kArgs, args_frame_addr.value, 4096,
+																			true, nullptr})) {
+				cleanup();
 				return { 0, err };
 		}
 		auto argv = reinterpret_cast<char**>(args_frame_addr.value);
@@ -608,12 +827,19 @@ WithError<int> Terminal::ExecuteFile(fat::DirectoryEntry& file_entry,
 		int argbuf_len = 4096 - sizeof(char**) * argv_len;
 		auto argc = MakeArgVector(command, first_arg, argv, argv_len, argbuf, argbuf_len);
 		if (argc.error) {
+				cleanup();
 				return { 0, argc.error };
 		}
 
 		const int stack_size = 16 * 4096;
 		LinearAddress4Level stack_frame_addr{0xffff'ffff'ffff'e000 - stack_size};
 		if (auto err = SetupPageMaps(stack_frame_addr, stack_size / 4096)) {
+				cleanup();
+				return { 0, err };
+		}
+		if (auto err = addr_space.Add(VMA{VMA::kStack, stack_frame_addr.value, stack_size,
+																			true, nullptr})) {
+				cleanup();
 				return { 0, err };
 		}
 
@@ -623,21 +849,16 @@ WithError<int> Terminal::ExecuteFile(fat::DirectoryEntry& file_entry,
 
 		const uint64_t elf_next_page =
 			(app_load.vaddr_end + 4095) & 0xffff'ffff'ffff'f000;
-		task.SetDPagingBegin(elf_next_page);
-		task.SetDPagingEnd(elf_next_page);
-
-		task.SetFileMapEnd(stack_frame_addr.value);
+		addr_space.SetupDynamicAreas(elf_next_page, stack_frame_addr.value);
 
 		int ret = CallApp(argc.value, argv, 3 << 3 | 3, app_load.entry,
 											stack_frame_addr.value + stack_size - 8,
 											&task.OSStackPointer());
 
 		task.Files().clear();
-		task.FileMaps().clear();
-    if (auto err = CleanPageMaps(LinearAddress4Level{0xffff'8000'0000'0000})) {
-        return { ret, err };
-    }
-    return { ret, FreePML4(task) };
+		// timers created by the app (negative values) are not read by anyone after it exits
+		timer_manager->CancelTimersIf(task.ID(), [](const Timer& t) { return t.Value() < 0; });
+    return { ret, cleanup() };
 }
 
 void Terminal::Print(char32_t c, const PixelColor& color) {
@@ -789,10 +1010,10 @@ void TaskTerminal(uint64_t task_id, int64_t data) {
 		}
 
 		auto add_blink_timer = [task_id](unsigned long t){
-				timer_manager->AddTimer(Timer{t + static_cast<int>(kTimerFreq * 0.5),
+				timer_manager->AddTimer(Timer{t + kNanosecondsPerSecond / 2,
 																			1, task_id});
 		};
-		add_blink_timer(timer_manager->CurrentTick());
+		add_blink_timer(CurrentNanoseconds());
 
 		bool window_isactive = false;
 
@@ -13,13 +13,7 @@
 #include "task.hpp"
 #include "layer.hpp"
 #include "fat.hpp"
-
-struct AppLoadInfo {
-		uint64_t vaddr_end, entry;
-		PageMapEntry* pml4;
-};
-
-extern std::map<fat::DirectoryEntry*, AppLoadInfo>* app_loads;
+#include "image_cache.hpp"
 
 struct TerminalDescriptor {
 		std::string command_line;
@@ -0,0 +1,138 @@
+/*
+* micro benchmark of BitmapMemoryManager::Allocate under fragmentation.
+* compares with the reference allocator which tests one bit at a time from the beginning.
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+#include "memory_manager.hpp"
+
+namespace {
+  /** @brief the algorithm of BitmapMemoryManager before the summary bitmap was introduced */
+  class LinearScanMemoryManager {
+   public:
+    LinearScanMemoryManager(size_t num_frames)
+        : alloc_map_((num_frames + 63) / 64), range_end_{num_frames} {}
+
+    WithError<FrameID> Allocate(size_t num_frames) {
+      size_t start_frame_id = 0;
+      while (true) {
+        size_t i = 0;
+        for (; i < num_frames; ++i) {
+          if (start_frame_id + i >= range_end_) {
+            return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+          }
+          if (GetBit(start_frame_id + i)) {
+            break;
+          }
+        }
+        if (i == num_frames) {
+          MarkAllocated(FrameID{start_frame_id}, num_frames);
+          return {FrameID{start_frame_id}, MAKE_ERROR(Error::kSuccess)};
+        }
+        start_frame_id += i + 1;
+      }
+    }
+
+    Error Free(FrameID start_frame, size_t num_frames) {
+      for (size_t i = 0; i < num_frames; ++i) {
+        SetBit(start_frame.ID() + i, false);
+      }
+      return MAKE_ERROR(Error::kSuccess);
+    }
+
+    void MarkAllocated(FrameID start_frame, size_t num_frames) {
+      for (size_t i = 0; i < num_frames; ++i) {
+        SetBit(start_frame.ID() + i, true);
+      }
+    }
+
+    void SetMemoryRange(FrameID range_begin, FrameID range_end) {
+      range_end_ = range_end.ID();
+    }
+
+   private:
+    std::vector<uint64_t> alloc_map_;
+    size_t range_end_;
+
+    bool GetBit(size_t frame) const {
+      return (alloc_map_[frame / 64] >> (frame % 64)) & 1;
+    }
+
+    void SetBit(size_t frame, bool allocated) {
+      if (allocated) {
+        alloc_map_[frame / 64] |= uint64_t{1} << (frame % 64);
+      } else {
+        alloc_map_[frame / 64] &= ~(uint64_t{1} << (frame % 64));
+      }
+    }
+  };
+
+  const size_t kNumFrames = 16_GiB / kBytesPerFrame;
+
+  /** @brief allocate 90% of frames leaving a free frame every 64 frames in the first half */
+  template <class MemoryManager>
+  void Fragment(MemoryManager& mgr) {
+    mgr.SetMemoryRange(FrameID{1}, FrameID{kNumFrames});
+    mgr.MarkAllocated(FrameID{0}, kNumFrames * 9 / 10);
+    for (size_t i = 0; i < kNumFrames / 2; i += 64) {
+      mgr.Free(FrameID{i + 63}, 1);
+    }
+  }
+
+  /** @brief allocate num_frames frames `count` times and free them. return ns per allocation
+  *
+  *   @param num_holes : the number of free frames in the first half to fill before measurement
+  */
+  template <class MemoryManager>
+  double Measure(MemoryManager& mgr, size_t num_frames, int count, size_t num_holes) {
+    for (size_t i = 0; i < num_holes; ++i) {
+      mgr.MarkAllocated(FrameID{i * 64 + 63}, 1);
+    }
+
+    std::vector<FrameID> frames;
+    frames.reserve(count);
+
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; ++i) {
+      auto [ frame, err ] = mgr.Allocate(num_frames);
+      if (err) {
+        printf("failed to allocate: %s\n", err.Name());
+        break;
+      }
+      frames.push_back(frame);
+    }
+    const auto end = std::chrono::steady_clock::now();
+
+    for (auto frame : frames) {
+      mgr.Free(frame, num_frames);
+    }
+    return std::chrono::duration<double, std::nano>(end - start).count() / count;
+  }
+
+  void Compare(const char* title, size_t num_frames, int count, size_t num_holes = 0) {
+    std::vector<char> map_buf(BitmapMemoryManager::MapBytes(kNumFrames));
+    auto bitmap = std::make_unique<BitmapMemoryManager>(kNumFrames, map_buf.data());
+    auto linear = std::make_unique<LinearScanMemoryManager>(kNumFrames);
+    Fragment(*bitmap);
+    Fragment(*linear);
+
+    const double t_bitmap = Measure(*bitmap, num_frames, count, num_holes);
+    const double t_linear = Measure(*linear, num_frames, count, num_holes);
+    printf("%-36s linear %12.0f ns/op, summary %9.0f ns/op (x%.0f)\n",
+           title, t_linear, t_bitmap, t_linear / t_bitmap);
+  }
+}
+
+int main(int argc, char** argv) {
+  printf("%lu frames (%llu GiB), 90%% allocated, a free frame every 64 frames in the first half\n",
+         kNumFrames, 16ull);
+  Compare("Allocate(1) x 2000 (fill holes)", 1, 2000);
+  Compare("Allocate(1) x 200 (no holes)", 1, 200, kNumFrames / 2 / 64);
+  Compare("Allocate(8) x 200", 8, 200);
+  Compare("Allocate(512) x 200", 512, 200);
+  return 0;
+}
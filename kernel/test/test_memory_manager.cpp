@@ -1,8 +1,16 @@
+#include <vector>
+
 #include <CppUTest/CommandLineTestRunner.h>
 #include "memory_manager.hpp"
 
+namespace {
+  /** @brief 4 GiB */
+  const size_t kTestFrameCount = size_t{1} << 20;
+}
+
 TEST_GROUP(MemoryManager) {
-  BitmapMemoryManager mgr;
+  std::vector<char> map_buf{std::vector<char>(BitmapMemoryManager::MapBytes(kTestFrameCount))};
+  BitmapMemoryManager mgr{kTestFrameCount, map_buf.data()};
 
   TEST_SETUP() {}
 
@@ -26,7 +34,7 @@ TEST(MemoryManager, AllocateMultipleLine) {
 }
 
 TEST(MemoryManager, AllocateNoEnoughMemory) {
-  const auto frame1 = mgr.Allocate(BitmapMemoryManager::kFrameCount + 1);
+  const auto frame1 = mgr.Allocate(mgr.FrameCount() + 1);
 
   CHECK_EQUAL(Error::kNoEnoughMemory, frame1.error.Cause());
   CHECK_EQUAL(kNullFrame.ID(), frame1.value.ID());
@@ -65,3 +73,165 @@ TEST(MemoryManager, SetMemoryRange) {
   CHECK_EQUAL(0, frame1.value.ID());
   CHECK_EQUAL(10, frame2.value.ID());
 }
+
+TEST(MemoryManager, AllocateSkipFullLines) {
+  const size_t num_full = BitmapMemoryManager::kBitsPerMapLine * BitmapMemoryManager::kBitsPerMapLine + 5;
+  mgr.MarkAllocated(FrameID{0}, num_full);
+  const auto frame1 = mgr.Allocate(1);
+  const auto frame2 = mgr.Allocate(BitmapMemoryManager::kBitsPerMapLine * 2);
+
+  CHECK_EQUAL(num_full, frame1.value.ID());
+  CHECK_EQUAL(num_full + 1, frame2.value.ID());
+}
+
+TEST(MemoryManager, AllocateFragmented) {
+  // free frames: 1, 3, 5, ..., 2 * kBitsPerMapLine - 1, and 2 * kBitsPerMapLine ~
+  for (size_t i = 0; i < BitmapMemoryManager::kBitsPerMapLine * 2; i += 2) {
+    mgr.MarkAllocated(FrameID{i}, 1);
+  }
+  const auto frame1 = mgr.Allocate(2);
+  const auto frame2 = mgr.Allocate(1);
+
+  CHECK_EQUAL(BitmapMemoryManager::kBitsPerMapLine * 2 - 1, frame1.value.ID());
+  CHECK_EQUAL(1, frame2.value.ID());
+}
+
+TEST(MemoryManager, FreeBeforeHint) {
+  const auto frame1 = mgr.Allocate(BitmapMemoryManager::kBitsPerMapLine * 3);
+  const auto frame2 = mgr.Allocate(1);
+  mgr.Free(FrameID{10}, 1);
+  const auto frame3 = mgr.Allocate(1);
+
+  CHECK_EQUAL(0, frame1.value.ID());
+  CHECK_EQUAL(BitmapMemoryManager::kBitsPerMapLine * 3, frame2.value.ID());
+  CHECK_EQUAL(10, frame3.value.ID());
+}
+
+TEST(MemoryManager, AllocateOddFrameCount) {
+  std::vector<char> buf(BitmapMemoryManager::MapBytes(100));
+  BitmapMemoryManager small_mgr{100, buf.data()};
+
+  // frames in the last line beyond the frame count are never allocated
+  const auto frame1 = small_mgr.Allocate(101);
+  CHECK_EQUAL(Error::kNoEnoughMemory, frame1.error.Cause());
+
+  const auto frame2 = small_mgr.Allocate(100);
+  CHECK_EQUAL(Error::kSuccess, frame2.error.Cause());
+  CHECK_EQUAL(0, frame2.value.ID());
+  CHECK_EQUAL(100, small_mgr.Stat().total_frames);
+}
+
+TEST(MemoryManager, AllocateOrder) {
+  const auto frame1 = mgr.AllocateOrder(3);
+  const auto frame2 = mgr.AllocateOrder(1);
+  const auto frame3 = mgr.AllocateOrder(3);
+
+  CHECK_EQUAL(0, frame1.value.ID());
+  CHECK_EQUAL(8, frame2.value.ID());
+  CHECK_EQUAL(16, frame3.value.ID());
+}
+
+TEST(MemoryManager, AllocateOrderAligned) {
+  const auto frame1 = mgr.Allocate(1);
+  const auto frame2 = mgr.AllocateOrder(2);
+  const auto frame3 = mgr.Allocate(1);
+
+  CHECK_EQUAL(0, frame1.value.ID());
+  CHECK_EQUAL(4, frame2.value.ID());
+  CHECK_EQUAL(1, frame3.value.ID());
+}
+
+TEST(MemoryManager, FreeOrderMerge) {
+  const auto frame1 = mgr.AllocateOrder(3);
+  const auto frame2 = mgr.AllocateOrder(3);
+  mgr.FreeOrder(frame1.value, 3);
+  mgr.FreeOrder(frame2.value, 3);
+  const auto frame3 = mgr.AllocateOrder(4);
+
+  CHECK_EQUAL(0, frame3.value.ID());
+  CHECK_EQUAL(mgr.FrameCount() >> kMaxFrameOrder,
+              mgr.Stat().free_blocks[kMaxFrameOrder] + 1);
+}
+
+TEST(MemoryManager, FreeOrderNotAligned) {
+  const auto err = mgr.FreeOrder(FrameID{1}, 1);
+
+  CHECK_EQUAL(Error::kIndexOutOfRange, err.Cause());
+}
+
+TEST(MemoryManager, StatFreeBlocks) {
+  mgr.SetMemoryRange(FrameID{1}, FrameID{64});
+  const auto stat = mgr.Stat();
+
+  // 1, 2-3, 4-7, 8-15, 16-31, 32-63
+  CHECK_EQUAL(1, stat.free_blocks[0]);
+  CHECK_EQUAL(1, stat.free_blocks[1]);
+  CHECK_EQUAL(1, stat.free_blocks[2]);
+  CHECK_EQUAL(1, stat.free_blocks[3]);
+  CHECK_EQUAL(1, stat.free_blocks[4]);
+  CHECK_EQUAL(1, stat.free_blocks[5]);
+  CHECK_EQUAL(0, stat.free_blocks[6]);
+}
+
+namespace {
+  BitmapMemoryManager* reclaim_mgr;
+  size_t reclaim_calls;
+
+  size_t ReclaimFrame16(size_t num_frames) {
+    ++reclaim_calls;
+    reclaim_mgr->Free(FrameID{16}, 1);
+    return 1;
+  }
+
+  size_t reclaim_nothing_calls;
+
+  size_t ReclaimNothing(size_t num_frames) {
+    ++reclaim_nothing_calls;
+    return 0;
+  }
+}
+
+TEST(MemoryManager, AllocateReclaim) {
+  mgr.SetMemoryRange(FrameID{1}, FrameID{64});
+  mgr.MarkAllocated(FrameID{1}, 63);
+  reclaim_mgr = &mgr;
+  reclaim_calls = 0;
+  CHECK_EQUAL(Error::kSuccess, mgr.AddReclaimer(ReclaimFrame16).Cause());
+
+  const auto frame = mgr.Allocate(1);
+  CHECK_EQUAL(Error::kSuccess, frame.error.Cause());
+  CHECK_EQUAL(16, frame.value.ID());
+  CHECK_EQUAL(1, reclaim_calls);
+
+  // the reclaimer does not free a 2-frame block. the allocation fails after one retry.
+  const auto block = mgr.AllocateOrder(1);
+  CHECK_EQUAL(Error::kNoEnoughMemory, block.error.Cause());
+  CHECK_EQUAL(2, reclaim_calls);
+}
+
+TEST(MemoryManager, AllocateReclaimInOrder) {
+  mgr.SetMemoryRange(FrameID{1}, FrameID{64});
+  mgr.MarkAllocated(FrameID{1}, 63);
+  reclaim_mgr = &mgr;
+  reclaim_calls = 0;
+  reclaim_nothing_calls = 0;
+  CHECK_EQUAL(Error::kSuccess, mgr.AddReclaimer(ReclaimFrame16).Cause());
+  CHECK_EQUAL(Error::kSuccess, mgr.AddReclaimer(ReclaimNothing).Cause());
+
+  // the first reclaimer frees enough. the second one is not called.
+  const auto frame = mgr.Allocate(1);
+  CHECK_EQUAL(Error::kSuccess, frame.error.Cause());
+  CHECK_EQUAL(16, frame.value.ID());
+  CHECK_EQUAL(1, reclaim_calls);
+  CHECK_EQUAL(0, reclaim_nothing_calls);
+
+  // 2 frames are requested and the first one frees only 1. the second one is asked for the rest.
+  const auto block = mgr.AllocateOrder(1);
+  CHECK_EQUAL(Error::kNoEnoughMemory, block.error.Cause());
+  CHECK_EQUAL(2, reclaim_calls);
+  CHECK_EQUAL(1, reclaim_nothing_calls);
+
+  CHECK_EQUAL(Error::kSuccess, mgr.AddReclaimer(ReclaimNothing).Cause());
+  CHECK_EQUAL(Error::kSuccess, mgr.AddReclaimer(ReclaimNothing).Cause());
+  CHECK_EQUAL(Error::kFull, mgr.AddReclaimer(ReclaimNothing).Cause());
+}
@@ -0,0 +1,106 @@
+#include <array>
+#include <cstdint>
+
+#include <CppUTest/CommandLineTestRunner.h>
+#include "swap.hpp"
+
+namespace {
+  const size_t kPageBytes = 4096;
+}
+
+TEST_GROUP(LZ) {
+  std::array<uint8_t, kPageBytes> src;
+  /** @brief room for an incompressible page with its literal length bytes */
+  std::array<uint8_t, kPageBytes + 64> compressed;
+  std::array<uint8_t, kPageBytes> restored;
+
+  TEST_SETUP() {
+    src.fill(0);
+    restored.fill(0xcc);
+  }
+
+  TEST_TEARDOWN() {}
+
+  size_t RoundTrip(size_t len) {
+    const size_t clen = LZCompress(src.data(), len, compressed.data(), compressed.size());
+    CHECK_TRUE(clen > 0);
+    CHECK_TRUE(LZDecompress(compressed.data(), clen, restored.data(), len));
+    MEMCMP_EQUAL(src.data(), restored.data(), len);
+    return clen;
+  }
+
+  /** @brief fill with bytes which never repeat 4 bytes within a page */
+  void FillIncompressible(size_t begin, size_t end) {
+    uint32_t x = 2463534242u;
+    for (size_t i = begin; i < end; ++i) {
+      x ^= x << 13;
+      x ^= x >> 17;
+      x ^= x << 5;
+      src[i] = x;
+    }
+  }
+};
+
+TEST(LZ, Incompressible) {
+  FillIncompressible(0, kPageBytes);
+  const size_t clen = RoundTrip(kPageBytes);
+  CHECK_TRUE(clen > kPageBytes);
+}
+
+TEST(LZ, AllZero) {
+  const size_t clen = RoundTrip(kPageBytes);
+  CHECK_TRUE(clen < 64);
+}
+
+TEST(LZ, LongMatch) {
+  for (size_t i = 0; i < kPageBytes; ++i) {
+    src[i] = i % 7;
+  }
+  const size_t clen = RoundTrip(kPageBytes);
+  CHECK_TRUE(clen < 64);
+}
+
+TEST(LZ, LastBytesAreLiterals) {
+  const size_t clen = RoundTrip(kPageBytes);
+  // the last sequence is a token with literals only, followed by 5 zeros
+  CHECK_EQUAL(5 << 4, compressed[clen - 6]);
+  for (size_t i = clen - 5; i < clen; ++i) {
+    CHECK_EQUAL(0, compressed[i]);
+  }
+}
+
+TEST(LZ, ShortInput) {
+  for (size_t len = 0; len <= 12; ++len) {
+    const size_t clen = RoundTrip(len);
+    CHECK_EQUAL(1 + len, clen);
+  }
+}
+
+TEST(LZ, LengthBoundaries) {
+  // literal and match lengths around the 4-bit token field (15) and a continuation byte (255)
+  const size_t lens[] = {14, 15, 16, 269, 270, 271, 524, 525, 526};
+  for (size_t lit_len : lens) {
+    for (size_t match_len : lens) {
+      if (lit_len + match_len + 64 > kPageBytes) {
+        continue;
+      }
+      src.fill(0);
+      restored.fill(0xcc);
+      // literals, then a match of the first match_len literals, then incompressible tail
+      FillIncompressible(0, lit_len);
+      for (size_t i = 0; i < match_len; ++i) {
+        src[lit_len + i] = src[i % lit_len];
+      }
+      FillIncompressible(lit_len + match_len, lit_len + match_len + 32);
+      RoundTrip(lit_len + match_len + 32);
+    }
+  }
+}
+
+TEST(LZ, BrokenInput) {
+  FillIncompressible(0, kPageBytes);
+  const size_t clen = LZCompress(src.data(), kPageBytes, compressed.data(), compressed.size());
+  CHECK_FALSE(LZDecompress(compressed.data(), clen - 1, restored.data(), kPageBytes));
+  CHECK_FALSE(LZDecompress(compressed.data(), clen, restored.data(), kPageBytes - 1));
+  CHECK_EQUAL(0, LZCompress(src.data(), kPageBytes, compressed.data(), kPageBytes));
+}
@@ -1,7 +1,11 @@
 #include "timer.hpp"
 
+#include <algorithm>
+
 #include "acpi.hpp"
+#include "asmfunc.h"
 #include "interrupt.hpp"
+#include "logger.hpp"
 #include "task.hpp"
 
 namespace {
@@ -10,24 +14,48 @@ namespace {
     volatile uint32_t& initial_count = *reinterpret_cast<uint32_t*>(0xfee00380);
     volatile uint32_t& current_count = *reinterpret_cast<uint32_t*>(0xfee00390);
     volatile uint32_t& divide_config = *reinterpret_cast<uint32_t*>(0xfee003e0);
+
+    const uint32_t kCPUIDInvariantTSC = 1u << 8; // CPUID.80000007H:EDX
+
+    /** @brief the TSC when CurrentNanoseconds() is 0 */
+    uint64_t tsc_base;
+    /** @brief nanoseconds per TSC count in fixed point (32 fractional bits) */
+    uint64_t ns_per_tsc;
+
+    bool InvariantTSC() {
+        uint32_t regs[4];
+        ReadCPUID(0x80000000, 0, regs);
+        if (regs[0] < 0x80000007) {
+            return false;
+        }
+        ReadCPUID(0x80000007, 0, regs);
+        return regs[3] & kCPUIDInvariantTSC;
+    }
 }
 
 void InitializeLAPICTimer() {
-    timer_manager = new TimerManager;
-
     divide_config = 0b1011; // divide 1:1
     lvt_timer = 0b001 << 16; // masked, one-shot
 
+    const uint64_t tsc_start = ReadTSC();
     StartLAPICTimer();
     acpi::WaitMilliseconds(100);
     const auto elapsed = LAPICTimerElapsed();
+    const uint64_t tsc_end = ReadTSC();
     StopLAPICTimer();
 
     lapic_timer_freq = static_cast<unsigned long>(elapsed) * 10;
+    tsc_freq = (tsc_end - tsc_start) * 10;
+    ns_per_tsc = (kNanosecondsPerSecond << 32) / tsc_freq;
+    tsc_base = tsc_end;
+    if (!InvariantTSC()) {
+        Log(kWarn, "TSC is not invariant. CurrentNanoseconds() may drift\n");
+    }
 
     divide_config = 0b1011; // divide 1:1
-    lvt_timer = (0b010 << 16) | InterruptVector::kLAPICTimer; // not-masked, periodic
-    initial_count = lapic_timer_freq / kTimerFreq;
+    lvt_timer = (0b000 << 16) | InterruptVector::kLAPICTimer; // not-masked, one-shot
+
+    timer_manager = new TimerManager;
 }
 
 void StartLAPICTimer() {
@@ -42,32 +70,106 @@ void StopLAPICTimer() {
     initial_count = 0;
 }
 
+unsigned long CurrentNanoseconds() {
+    const unsigned __int128 elapsed = ReadTSC() - tsc_base;
+    return (elapsed * ns_per_tsc) >> 32;
+}
+
 Timer::Timer(unsigned long timeout, int value, uint64_t task_id)
     : timeout_{timeout}, value_{value}, task_id_{task_id} {
 }
 
-TimerManager::TimerManager() {
-    timers_.push(Timer{std::numeric_limits<unsigned long>::max(), 0, 0});
+TimerManager::TimerManager()
+    : nodes_(kMaxTimers), wheel_time_{CurrentNanoseconds() >> kWheelShift} {
+    heads_.fill(kNil);
+    for (uint32_t i = 0; i < nodes_.size(); ++i) {
+        nodes_[i].next = i + 1 < nodes_.size() ? i + 1 : kNil;
+        nodes_[i].generation = 0;
+        nodes_[i].list = kNoList;
+    }
+    free_head_ = 0;
+    num_free_ = nodes_.size();
+    deadline_ = std::numeric_limits<unsigned long>::max();
+}
+
+WithError<uint64_t> TimerManager::AddTimer(const Timer& timer) {
+    InterruptGuard guard;
+    TaskTimers* timers = TimersOf(timer.TaskID());
+    if (timers == nullptr) {
+        return { 0, MAKE_ERROR(Error::kNoSuchTask) };
+    }
+    const bool app_timer = timer.Value() < 0;
+    if (app_timer && (timers->num_app_timers >= kMaxAppTimersPerTask ||
+                      num_free_ <= kKernelReservedTimers)) {
+        return { 0, MAKE_ERROR(Error::kFull) };
+    }
+    if (free_head_ == kNil) {
+        Log(kWarn, "no timer is available (value %d, task %lu)\n", timer.Value(), timer.TaskID());
+        return { 0, MAKE_ERROR(Error::kFull) };
+    }
+    const uint32_t index = free_head_;
+    auto& node = nodes_[index];
+    free_head_ = node.next;
+    --num_free_;
+    node.timer = timer;
+    Place(index);
+
+    node.owner = timers;
+    node.task_prev = kNil;
+    node.task_next = timers->head;
+    if (node.task_next != kNil) {
+        nodes_[node.task_next].task_prev = index;
+    }
+    timers->head = index;
+    timers->num_app_timers += app_timer;
+
+    if (timer.Timeout() < deadline_) {
+        ProgramLAPICTimer(timer.Timeout());
+    }
+    // 0 is never a handle
+    return { static_cast<uint64_t>(node.generation) << 32 | (index + 1), MAKE_ERROR(Error::kSuccess) };
+}
+
+Error TimerManager::CancelTimer(uint64_t handle) {
+    InterruptGuard guard;
+    const uint64_t index = (handle & 0xffffffffu) - 1;
+    if (index >= nodes_.size()) {
+        return MAKE_ERROR(Error::kNoSuchEntry);
+    }
+    const auto& node = nodes_[index];
+    if (node.list == kNoList || node.generation != (handle >> 32)) {
+        return MAKE_ERROR(Error::kNoSuchEntry);
+    }
+    // the LAPIC timer is left as it is. an early interrupt only finds nothing expired.
+    Unlink(index);
+    FreeNode(index);
+    return MAKE_ERROR(Error::kSuccess);
 }
 
-void TimerManager::AddTimer(const Timer& timer) {
-    timers_.push(timer);
+size_t TimerManager::CancelTimers(uint64_t task_id) {
+    return CancelTimersIf(task_id, [](const Timer&) { return true; });
 }
 
 bool TimerManager::Tick() {
-    ++tick_;
+    const auto now = CurrentNanoseconds();
+    Collect(now);
 
     bool task_timer_timeout = false;
-    while (true) {
-        const auto& t = timers_.top();
-        if (t.Timeout() > tick_) {
-            break;
-        }
+    while (heads_[kExpiredList] != kNil) {
+        const uint32_t index = heads_[kExpiredList];
+        const Timer t = nodes_[index].timer;
+        // sending a message may add timers
+        Unlink(index);
+        FreeNode(index);
 
         if (t.Value() == kTaskTimerValue) {
             task_timer_timeout = true;
-            timers_.pop();
-            timers_.push(Timer{tick_ + kTaskTimerPeriod, kTaskTimerValue, 1});
+            // nothing to switch to. stop the task timer until a task wakes up
+            task_timer_running_ = !task_manager->Idle();
+            if (task_timer_running_) {
+                // if it fails, StartTaskTimer tries again when a task wakes up
+                task_timer_running_ = !AddTimer(Timer{now + kTaskTimerPeriod, kTaskTimerValue, 1}).error;
+            }
             continue;
         }
 
@@ -75,15 +177,190 @@ bool TimerManager::Tick() {
         m.arg.timer.timeout = t.Timeout();
         m.arg.timer.value = t.Value();
         task_manager->SendMessage(t.TaskID(), m);
-
-        timers_.pop();
     }
 
+    ProgramLAPICTimer(NextDeadline());
     return task_timer_timeout;
 }
 
+unsigned long TimerManager::CurrentTick() const {
+    return CurrentNanoseconds() / (kNanosecondsPerSecond / kTimerFreq);
+}
+
+void TimerManager::StartTaskTimer() {
+    InterruptGuard guard;
+    if (task_timer_running_) {
+        return;
+    }
+    task_timer_running_ = !AddTimer(Timer{CurrentNanoseconds(), kTaskTimerValue, 1}).error;
+}
+
+TaskTimers* TimerManager::TimersOf(uint64_t task_id) {
+    Task* task = task_manager->FindTask(task_id);
+    return task ? &task->Timers() : nullptr;
+}
+
+void TimerManager::FreeNode(uint32_t index) {
+    auto& node = nodes_[index];
+    if (node.task_prev != kNil) {
+        nodes_[node.task_prev].task_next = node.task_next;
+    } else {
+        node.owner->head = node.task_next;
+    }
+    if (node.task_next != kNil) {
+        nodes_[node.task_next].task_prev = node.task_prev;
+    }
+    node.owner->num_app_timers -= node.timer.Value() < 0;
+    node.owner = nullptr;
+    ++num_free_;
+
+    ++node.generation;
+    node.list = kNoList;
+    node.next = free_head_;
+    free_head_ = index;
+}
+
+void TimerManager::Link(uint32_t index, uint16_t list) {
+    auto& node = nodes_[index];
+    node.list = list;
+    node.prev = kNil;
+    node.next = heads_[list];
+    if (node.next != kNil) {
+        nodes_[node.next].prev = index;
+    }
+    heads_[list] = index;
+    if (list < kExpiredList) {
+        occupied_[list / kWheelSize] |= 1ul << (list % kWheelSize);
+    }
+}
+
+void TimerManager::Unlink(uint32_t index) {
+    auto& node = nodes_[index];
+    if (node.prev != kNil) {
+        nodes_[node.prev].next = node.next;
+    } else {
+        heads_[node.list] = node.next;
+    }
+    if (node.next != kNil) {
+        nodes_[node.next].prev = node.prev;
+    }
+    if (node.list < kExpiredList && heads_[node.list] == kNil) {
+        occupied_[node.list / kWheelSize] &= ~(1ul << (node.list % kWheelSize));
+    }
+}
+
+void TimerManager::Place(uint32_t index) {
+    // a timeout already passed goes to the current slot of level 0
+    const unsigned long expire = std::max(nodes_[index].timer.Timeout() >> kWheelShift,
+                                          wheel_time_);
+    for (int level = 0; level < kWheelLevels; ++level) {
+        const int shift = kWheelBits * level;
+        // the current slot of upper levels has been cascaded already,
+        // but the lower level takes the timer in that case.
+        if ((expire >> shift) - (wheel_time_ >> shift) < kWheelSize) {
+            Link(index, level * kWheelSize + ((expire >> shift) & (kWheelSize - 1)));
+            return;
+        }
+    }
+
+    // beyond the range of the wheel. wait in the last slot of the top level and be placed again.
+    const int top = kWheelLevels - 1;
+    const unsigned long last_slot = (wheel_time_ >> (kWheelBits * top)) + kWheelSize - 1;
+    Link(index, top * kWheelSize + (last_slot & (kWheelSize - 1)));
+}
+
+void TimerManager::Cascade(int level) {
+    const unsigned long slot = (wheel_time_ >> (kWheelBits * level)) & (kWheelSize - 1);
+    auto& head = heads_[level * kWheelSize + slot];
+    // Place never links a timer to the current slot of this level, so the loop ends
+    while (head != kNil) {
+        const uint32_t index = head;
+        Unlink(index);
+        Place(index);
+    }
+}
+
+void TimerManager::Collect(unsigned long now) {
+    const unsigned long now_slot = now >> kWheelShift;
+    while (true) {
+        auto index = heads_[wheel_time_ & (kWheelSize - 1)];
+        while (index != kNil) {
+            const auto next = nodes_[index].next;
+            if (nodes_[index].timer.Timeout() <= now) {
+                Unlink(index);
+                Link(index, kExpiredList);
+            }
+            index = next;
+        }
+        // timers later than now in the current slot are left for the next interrupt
+        if (wheel_time_ >= now_slot) {
+            break;
+        }
+
+        // skip empty slots of level 0, but stop at the end of the level-0 round to cascade
+        const unsigned long pos = wheel_time_ & (kWheelSize - 1);
+        const uint64_t later = pos == kWheelSize - 1 ? 0 : occupied_[0] & (~0ul << (pos + 1));
+        const unsigned long next_time = later ? (wheel_time_ & ~(kWheelSize - 1ul)) + __builtin_ctzl(later)
+                                              : (wheel_time_ | (kWheelSize - 1)) + 1;
+        wheel_time_ = std::min(next_time, now_slot);
+
+        for (int level = kWheelLevels - 1; level > 0; --level) {
+            if ((wheel_time_ & ((1ul << (kWheelBits * level)) - 1)) == 0) {
+                Cascade(level);
+            }
+        }
+    }
+}
+
+unsigned long TimerManager::NextDeadline() const {
+    unsigned long deadline = std::numeric_limits<unsigned long>::max();
+
+    if (occupied_[0]) {
+        const int pos = wheel_time_ & (kWheelSize - 1);
+        const uint64_t rotated = pos == 0 ? occupied_[0]
+                                          : occupied_[0] >> pos | occupied_[0] << (kWheelSize - pos);
+        const int slot = (pos + __builtin_ctzl(rotated)) & (kWheelSize - 1);
+        for (auto index = heads_[slot]; index != kNil; index = nodes_[index].next) {
+            deadline = std::min(deadline, nodes_[index].timer.Timeout());
+        }
+    }
+
+    // timers in upper levels do not expire before their slots are cascaded
+    for (int level = 1; level < kWheelLevels; ++level) {
+        if (occupied_[level] == 0) {
+            continue;
+        }
+        const int shift = kWheelBits * level;
+        const unsigned long current = wheel_time_ >> shift;
+        const int pos = current & (kWheelSize - 1);
+        const uint64_t rotated = pos == 0 ? occupied_[level]
+                                          : occupied_[level] >> pos | occupied_[level] << (kWheelSize - pos);
+        const unsigned long cascade_time = (current + __builtin_ctzl(rotated)) << shift;
+        deadline = std::min(deadline, cascade_time << kWheelShift);
+    }
+    return deadline;
+}
+
+void TimerManager::ProgramLAPICTimer(unsigned long deadline) {
+    const auto now = CurrentNanoseconds();
+    // the LAPIC timer counts for up to kCountMax. (ns * counts/s) fits in 64 bits within the range.
+    const unsigned long max_ns = kCountMax * kNanosecondsPerSecond / lapic_timer_freq;
+
+    unsigned long counts = 1;
+    deadline_ = deadline;
+    if (deadline > now) {
+        // a timeout too far away is reached by several interrupts
+        deadline_ = std::min(deadline, now + max_ns);
+        // round up not to fire before the deadline
+        counts = ((deadline_ - now) * lapic_timer_freq + kNanosecondsPerSecond - 1)
+                 / kNanosecondsPerSecond;
+    }
+    initial_count = counts;
+}
+
 TimerManager* timer_manager;
 unsigned long lapic_timer_freq;
+unsigned long tsc_freq;
 
 extern "C" void LAPICTimerOnInterrupt(const TaskContext& ctx_stack) {
     const bool task_timer_timeout = timer_manager->Tick();
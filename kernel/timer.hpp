@@ -1,18 +1,27 @@
 #pragma once
 
+#include <array>
 #include <cstdint>
-#include <queue>
 #include <vector>
 #include <limits>
+#include "error.hpp"
+#include "interrupt.hpp"
 #include "message.hpp"
 
+/** @brief calibrate the TSC and the LAPIC timer by the ACPI PM timer and start TimerManager */
 void InitializeLAPICTimer();
 void StartLAPICTimer();
 uint32_t LAPICTimerElapsed();
 void StopLAPICTimer();
 
+const unsigned long kNanosecondsPerSecond = 1'000'000'000;
+
+/** @brief nanoseconds since InitializeLAPICTimer counted by the TSC (monotonic) */
+unsigned long CurrentNanoseconds();
+
 class Timer {
     public:
+        /** @brief timeout is the time of CurrentNanoseconds() when the timer expires */
         Timer(unsigned long timeout, int value, uint64_t task_id);
         unsigned long Timeout() const { return timeout_; }
         int Value() const { return value_; }
@@ -24,26 +33,136 @@ class Timer {
 				uint64_t task_id_;
 };
 
-/** @brief compare priority of timer. Longer timeout is, lower priority is*/
-inline bool operator<(const Timer& lhs, const Timer& rhs) {
-    return lhs.Timeout() > rhs.Timeout();
-}
+/** @brief the timers of a task, chained by TimerManager. Task holds this */
+struct TaskTimers {
+    uint32_t head = std::numeric_limits<uint32_t>::max();
+    /** @brief the number of timers created by the app (negative values) */
+    size_t num_app_timers = 0;
+};
 
+/** @brief manage timers by the local APIC timer in one-shot mode (tickless).
+*
+*   The LAPIC timer is programmed to fire at the earliest timeout instead of every tick.
+*   Time is read from CurrentNanoseconds(), so timeouts are not rounded to ticks.
+*   The task timer (scheduler slice) is stopped while only the idle task is runnable.
+*
+*   Timers are kept in a hierarchical timing wheel of kWheelLevels levels with kWheelSize slots.
+*   A slot of level 0 spans 2^kWheelShift ns (about 1 ms) and a slot of level n spans
+*   kWheelSize^n slots of level 0. A timer is put in the lowest level whose range covers it,
+*   and the timers in a slot of a higher level are moved down (cascaded) when level 0 reaches it.
+*   Slots are intrusive lists of nodes in a pool allocated beforehand, so adding and
+*   cancelling a timer take O(1) without allocating memory.
+*
+*   Each node is also chained to TaskTimers of its task, so the timers of a task are
+*   cancelled without scanning the pool. Timers of apps (negative values) are limited to
+*   kMaxAppTimersPerTask per task, and cannot use the last kKernelReservedTimers nodes.
+*/
 class TimerManager {
     public:
+        static constexpr int kWheelShift = 20;
+        static constexpr int kWheelBits = 6;
+        static constexpr int kWheelSize = 1 << kWheelBits;
+        static constexpr int kWheelLevels = 6;
+        static constexpr size_t kMaxTimers = 4096;
+        static constexpr size_t kKernelReservedTimers = 256;
+        static constexpr size_t kMaxAppTimersPerTask = 256;
+
         TimerManager();
-        void AddTimer(const Timer& timer);
+        /** @brief add a timer. the returned handle is passed to CancelTimer.
+        *
+        *   kFull if the pool or the limit of app timers is exhausted, kNoSuchTask if the task does not exist.
+        */
+        WithError<uint64_t> AddTimer(const Timer& timer);
+        /** @brief cancel a timer not expired yet. kNoSuchEntry if it has expired or been cancelled */
+        Error CancelTimer(uint64_t handle);
+        /** @brief cancel all the timers of the task. return the number of cancelled timers */
+        size_t CancelTimers(uint64_t task_id);
+
+        /** @brief cancel the timers of the task for which pred(const Timer&) returns true */
+        template <class F>
+        size_t CancelTimersIf(uint64_t task_id, F pred) {
+            InterruptGuard guard;
+            const TaskTimers* timers = TimersOf(task_id);
+            if (timers == nullptr) {
+                return 0;
+            }
+            size_t num_cancelled = 0;
+            for (uint32_t i = timers->head; i != kNil; ) {
+                const uint32_t next = nodes_[i].task_next;
+                if (pred(nodes_[i].timer)) {
+                    Unlink(i);
+                    FreeNode(i);
+                    ++num_cancelled;
+                }
+                i = next;
+            }
+            return num_cancelled;
+        }
+
+        /** @brief called on the LAPIC timer interrupt. return true if the task timer has expired */
         bool Tick();
-        unsigned long CurrentTick() const { return tick_; }
-    
+        /** @brief CurrentNanoseconds() in the unit of 1 / kTimerFreq seconds */
+        unsigned long CurrentTick() const;
+        /** @brief restart the task timer stopped while idle so that the scheduler runs at once */
+        void StartTaskTimer();
+
     private:
-        volatile unsigned long tick_{0};
-        std::priority_queue<Timer> timers_{};
+        static constexpr uint32_t kNil = std::numeric_limits<uint32_t>::max();
+        /** @brief the list of timers collected by Tick and not yet sent */
+        static constexpr uint16_t kExpiredList = kWheelLevels * kWheelSize;
+        static constexpr uint16_t kNoList = kExpiredList + 1;
+
+        struct Node {
+            Timer timer{0, 0, 0};
+            uint32_t prev, next;
+            /** @brief links in TaskTimers of owner */
+            uint32_t task_prev, task_next;
+            TaskTimers* owner;
+            /** @brief incremented on free so that a stale handle does not match */
+            uint32_t generation;
+            /** @brief level * kWheelSize + slot, kExpiredList or kNoList (free) */
+            uint16_t list;
+        };
+
+        std::vector<Node> nodes_;
+        uint32_t free_head_{kNil};
+        size_t num_free_{0};
+        std::array<uint32_t, kWheelLevels * kWheelSize + 1> heads_;
+        /** @brief bit n of occupied_[level] is set if slot n of the level is not empty */
+        std::array<uint64_t, kWheelLevels> occupied_{};
+        /** @brief the current slot of level 0 in the unit of 2^kWheelShift ns.
+        *   timers before it have been collected. */
+        unsigned long wheel_time_;
+
+        /** @brief the time when the LAPIC timer fires next */
+        unsigned long deadline_{0};
+        bool task_timer_running_{false};
+
+        /** @brief TaskTimers of the task, or nullptr if it does not exist */
+        TaskTimers* TimersOf(uint64_t task_id);
+        /** @brief unchain the node from its task and return it to the pool. it must be unlinked first */
+        void FreeNode(uint32_t index);
+        void Link(uint32_t index, uint16_t list);
+        void Unlink(uint32_t index);
+        /** @brief link the node to the slot covering its timeout */
+        void Place(uint32_t index);
+        /** @brief move the timers in the current slot of the level to lower levels */
+        void Cascade(int level);
+        /** @brief advance the wheel up to now and move expired timers to kExpiredList */
+        void Collect(unsigned long now);
+        /** @brief the earliest time when Tick has to run. it may be a cascade point, not a timeout */
+        unsigned long NextDeadline() const;
+        /** @brief make the LAPIC timer fire at the given time, or as early as possible if it has passed */
+        void ProgramLAPICTimer(unsigned long deadline);
 };
 
 extern TimerManager* timer_manager;
 extern unsigned long lapic_timer_freq;
+/** @brief the frequency of the TSC (Hz) */
+extern unsigned long tsc_freq;
+/** @brief ticks per second of CurrentTick() */
 const int kTimerFreq = 100;
 
-const int kTaskTimerPeriod = static_cast<int>(kTimerFreq * 0.02);
+/** @brief the scheduler slice (ns) */
+const unsigned long kTaskTimerPeriod = kNanosecondsPerSecond / 50;
 const int kTaskTimerValue = std::numeric_limits<int>::max();
\ No newline at end of file